@@ -0,0 +1,142 @@
+#include "arena.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Small allocations share chunks of this size; anything above a quarter of it gets a chunk of its own
+#define ARENA_CHUNK_SIZE (16 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+#define SMALL_PAGE_SIZE 4096
+
+bool Arena::useHugePages = false;
+
+Arena::~Arena()
+{
+    for (auto& chunk : this->chunks)
+        freeAligned(chunk.base);
+    for (auto& file : this->files)
+        file.close();
+    for (void* block : this->blocks)
+        free(block);
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->allocated += size;
+
+    // Small allocations go to the most recent shared chunk, which is always the last one (dedicated
+    // chunks are full, so they never take one)
+    bool shared = size <= ARENA_CHUNK_SIZE / 4;
+    if (shared && !this->chunks.empty()) {
+        Chunk& chunk = this->chunks.back();
+        size_t offset = (chunk.used + alignment - 1) & ~(alignment - 1);
+        if (offset + size <= chunk.size) {
+            chunk.used = offset + size;
+            return chunk.base + offset;
+        }
+    }
+
+    size_t pageSize = Arena::useHugePages ? HUGE_PAGE_SIZE : SMALL_PAGE_SIZE;
+    size_t chunkSize = shared ? ARENA_CHUNK_SIZE : (size + pageSize - 1) & ~(pageSize - 1);
+    uint8_t* base = (uint8_t*)mallocAligned(chunkSize, pageSize);
+    if (!base) {
+        std::cerr << "Out of memory allocating " << chunkSize / (1024.f * 1024.f) << " MB" << std::endl;
+        exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (Arena::useHugePages)
+        madvise(base, chunkSize, MADV_HUGEPAGE);
+#endif
+    this->reserved += chunkSize;
+
+    // A dedicated chunk goes in front of the shared one so that the latter stays last
+    Chunk chunk = {base, chunkSize, shared ? size : chunkSize};
+    if (shared || this->chunks.empty())
+        this->chunks.push_back(chunk);
+    else
+        this->chunks.insert(this->chunks.end() - 1, chunk);
+    return base;
+}
+
+void Arena::adopt(MappedFile file)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->mapped += file.size;
+    this->files.push_back(file);
+}
+
+void Arena::adopt(void* block, size_t size)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->allocated += size;
+    this->reserved += size;
+    this->blocks.push_back(block);
+}
+
+bool MappedFile::open(const std::string& path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : nullptr;
+    if (!view) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    this->fileHandle = file;
+    this->mappingHandle = mapping;
+    this->data = (uint8_t*)view;
+    this->size = size_t(fileSize.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file alive, so the descriptor is not needed past this point
+    void* view = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED) return false;
+
+    this->data = (uint8_t*)view;
+    this->size = size_t(st.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (!this->data) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(this->data);
+    CloseHandle(this->mappingHandle);
+    CloseHandle(this->fileHandle);
+#else
+    munmap(this->data, this->size);
+#endif
+    this->data = nullptr;
+    this->size = 0;
+}
@@ -0,0 +1,513 @@
+#include "scene.h"
+
+// Microbenchmarks for the hot paths of the renderer. Each one runs against a real scene so the
+// numbers reflect the memory layout the renderer actually sees.
+
+int option = 0;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::vector<Ray> cameraRays(Scene& scene)
+{
+    std::vector<Ray> rays;
+    for (int y = 0; y < scene.imageResolution.y; y++)
+        for (int x = 0; x < scene.imageResolution.x; x++)
+            rays.push_back(scene.camera.generateRay(x, y));
+
+    return rays;
+}
+
+// Closest-hit traversal only writes a HitRecord; the full Interaction is built once per ray
+static void benchTraversal(Scene& scene, int iterations)
+{
+    std::vector<Ray> rays = cameraRays(scene);
+
+    int hits = 0;
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto ray : rays) {
+            HitRecord hit;
+            scene.intersectBVH(ray, hit);
+            hits += hit.didIntersect();
+        }
+    }
+    double traversal = secondsSince(start);
+
+    start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto ray : rays) {
+            Interaction si = scene.rayIntersect(ray);
+            hits += si.didIntersect;
+        }
+    }
+    double full = secondsSince(start);
+
+    double numRays = double(rays.size()) * iterations;
+    std::cout << "traversal: " << sizeof(HitRecord) << " byte hit record, " << sizeof(Interaction) << " byte interaction" << std::endl;
+    std::cout << "  closest hit only:       " << numRays / traversal / 1e6 << " Mrays/s" << std::endl;
+    std::cout << "  closest hit + shading:  " << numRays / full / 1e6 << " Mrays/s" << std::endl;
+    std::cout << "  (" << hits << " hits)" << std::endl;
+}
+
+// Shadow rays towards every light from every camera hit, with the distance to the light
+static std::vector<Ray> shadowRays(Scene& scene, std::vector<float>& distances)
+{
+    std::vector<Ray> rays;
+    for (auto ray : cameraRays(scene)) {
+        Interaction si = scene.rayIntersect(ray);
+        if (!si.didIntersect) continue;
+
+        for (auto& light : scene.lights) {
+            Vector3f origin = si.p + 0.001f * si.n;
+            if (light.lightType == DIRECTIONAL_LIGHT) {
+                rays.push_back(Ray(origin, light.locationOrDirection));
+                distances.push_back(1e30f);
+            }
+            else {
+                Vector3f toLight = light.locationOrDirection - si.p;
+                rays.push_back(Ray(origin, Normalize(toLight)));
+                distances.push_back(toLight.Length());
+            }
+        }
+    }
+
+    return rays;
+}
+
+// Closest-hit query vs any-hit query on the same shadow rays
+static void benchOcclusion(Scene& scene, int iterations)
+{
+    std::vector<float> distances;
+    std::vector<Ray> shadowRays = ::shadowRays(scene, distances);
+
+    int blocked = 0;
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < shadowRays.size(); i++) {
+            Ray ray = shadowRays[i];
+            HitRecord hit;
+            scene.intersectBVH(ray, hit);
+            blocked += hit.didIntersect() && hit.t < distances[i];
+        }
+    }
+    double closest = secondsSince(start);
+
+    start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < shadowRays.size(); i++)
+            blocked -= scene.occluded(shadowRays[i], distances[i]);
+    }
+    double anyHit = secondsSince(start);
+
+    double numRays = double(shadowRays.size()) * iterations;
+    std::cout << "occlusion: " << shadowRays.size() << " shadow rays" << std::endl;
+    std::cout << "  closest hit + distance: " << numRays / closest / 1e6 << " Mrays/s" << std::endl;
+    std::cout << "  any hit with tmax:      " << numRays / anyHit / 1e6 << " Mrays/s" << std::endl;
+    if (blocked != 0)
+        std::cout << "  WARNING: the two queries disagree on " << blocked << " rays" << std::endl;
+}
+
+// Nodes visited per ray with left-first traversal vs nearest-child-first traversal
+static void benchTraversalOrder(Scene& scene)
+{
+    std::vector<float> distances;
+    std::vector<Ray> primary = cameraRays(scene);
+    std::vector<Ray> shadow = shadowRays(scene, distances);
+
+    std::cout << "traversal order: nodes visited (primitives tested) per ray" << std::endl;
+    for (int ordered = 0; ordered < 2; ordered++) {
+        bvhSettings.orderedTraversal = ordered;
+
+        TraversalStats primaryStats, shadowStats;
+        for (auto ray : primary) {
+            HitRecord hit;
+            scene.intersectBVH(ray, hit, &primaryStats);
+        }
+        for (size_t i = 0; i < shadow.size(); i++)
+            scene.occluded(shadow[i], distances[i], &shadowStats);
+
+        std::cout << (ordered ? "  nearest first:  " : "  left first:     ")
+            << "camera " << double(primaryStats.nodesVisited) / primary.size()
+            << " (" << double(primaryStats.primsTested) / primary.size() << "), "
+            << "shadow " << double(shadowStats.nodesVisited) / std::max<size_t>(shadow.size(), 1)
+            << " (" << double(shadowStats.primsTested) / std::max<size_t>(shadow.size(), 1) << ")" << std::endl;
+    }
+}
+
+// The slab test as it was before rays carried their reciprocal direction: six divisions per box
+static float intersectsDivide(const AABB& box, Ray ray)
+{
+    float tx1 = (box.min.x - ray.o.x) / ray.d.x, tx2 = (box.max.x - ray.o.x) / ray.d.x;
+    float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+    float ty1 = (box.min.y - ray.o.y) / ray.d.y, ty2 = (box.max.y - ray.o.y) / ray.d.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)), tmax = std::min(tmax, std::max(ty1, ty2));
+    float tz1 = (box.min.z - ray.o.z) / ray.d.z, tz2 = (box.max.z - ray.o.z) / ray.d.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)), tmax = std::min(tmax, std::max(tz1, tz2));
+    if (tmax >= tmin && tmin < ray.t && tmax > 0) return tmin;
+    return NO_INTERSECTION;
+}
+
+// Every camera ray against the top levels of every surface BVH, so the boxes stay in cache
+// and the numbers measure the test itself rather than memory traffic
+static void benchBoxTests(Scene& scene, int iterations)
+{
+    std::vector<Ray> rays = cameraRays(scene);
+
+    std::vector<AABB> boxes;
+    for (auto& surf : scene.surfaces)
+        for (int i = 0; i < std::min(surf.numBVHNodes, 64); i++)
+            boxes.push_back(surf.nodes[i].bbox);
+
+    int hitsBefore = 0, hitsAfter = 0;
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+        for (auto& ray : rays)
+            for (auto& box : boxes)
+                hitsBefore += intersectsDivide(box, ray) != NO_INTERSECTION;
+    double before = secondsSince(start);
+
+    start = Clock::now();
+    for (int it = 0; it < iterations; it++)
+        for (auto& ray : rays)
+            for (auto& box : boxes)
+                hitsAfter += box.intersects(ray) != NO_INTERSECTION;
+    double after = secondsSince(start);
+
+    double numTests = double(rays.size()) * boxes.size() * iterations;
+    std::cout << "box tests: " << boxes.size() << " boxes x " << rays.size() << " rays" << std::endl;
+    std::cout << "  divide per test:        " << numTests / before / 1e6 << " Mtests/s" << std::endl;
+    std::cout << "  reciprocal + sign bits: " << numTests / after / 1e6 << " Mtests/s" << std::endl;
+    if (hitsBefore != hitsAfter)
+        std::cout << "  WARNING: the two tests disagree on " << hitsBefore - hitsAfter << " boxes" << std::endl;
+}
+
+// Every 16th camera ray against the first leaf blocks of every surface, one triangle at a time
+// with Surface::rayTriangleIntersect and one block at a time with TriBlock::intersect
+static void benchTriangleTests(Scene& scene, int iterations)
+{
+    std::vector<Ray> allRays = cameraRays(scene), rays;
+    for (size_t i = 0; i < allRays.size(); i += 16)
+        rays.push_back(allRays[i]);
+
+    std::vector<std::pair<Surface*, const TriBlock*>> blocks;
+    for (auto& surf : scene.surfaces)
+        for (int i = 0; i < std::min(surf.numTriBlocks, 64); i++)
+            blocks.push_back(std::make_pair(&surf, &surf.triBlocks[i]));
+
+    int hitsScalar = 0, hitsBlock = 0, numTris = 0;
+    for (auto& block : blocks)
+        for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++)
+            numTris += block.second->triIdx[lane] != NO_HIT;
+
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto& ray : rays) {
+            for (auto& block : blocks) {
+                for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++) {
+                    HitRecord hit;
+                    if (block.second->triIdx[lane] != NO_HIT)
+                        hitsScalar += block.first->rayTriangleIntersect(ray, block.second->triIdx[lane], hit);
+                }
+            }
+        }
+    }
+    double scalar = secondsSince(start);
+
+    float t[TRI_BLOCK_SIZE], b1[TRI_BLOCK_SIZE], b2[TRI_BLOCK_SIZE];
+    start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto& ray : rays) {
+            for (auto& block : blocks) {
+                for (int mask = block.second->intersect(ray, t, b1, b2); mask != 0; mask >>= 1)
+                    hitsBlock += mask & 1;
+            }
+        }
+    }
+    double simd = secondsSince(start);
+
+    double numTests = double(rays.size()) * numTris * iterations;
+    std::cout << "triangle tests: " << numTris << " triangles in " << blocks.size() << " blocks of " << TRI_BLOCK_SIZE
+        << " x " << rays.size() << " rays" << std::endl;
+    std::cout << "  one at a time:          " << numTests / scalar / 1e6 << " Mtests/s" << std::endl;
+    std::cout << "  SoA blocks:             " << numTests / simd / 1e6 << " Mtests/s" << std::endl;
+    if (hitsScalar != hitsBlock)
+        std::cout << "  (" << hitsScalar - hitsBlock << " edge hits differ by rounding)" << std::endl;
+}
+
+// Camera rays one at a time vs in square packets, image-wide; the packet results must match
+static void benchPackets(Scene& scene, int iterations)
+{
+    int width = scene.imageResolution.x, height = scene.imageResolution.y;
+    std::vector<Ray> rays = cameraRays(scene);
+    std::vector<HitRecord> single(rays.size());
+
+    TraversalStats singleStats;
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < rays.size(); i++) {
+            Ray ray = rays[i];
+            single[i] = HitRecord();
+            scene.intersectBVH(ray, single[i], it == 0 ? &singleStats : nullptr);
+        }
+    }
+    double singleTime = secondsSince(start);
+
+    double numRays = double(rays.size()) * iterations;
+    std::cout << "packets: nodes visited (primitives tested) per camera ray" << std::endl;
+    std::cout << "  single rays:            " << numRays / singleTime / 1e6 << " Mrays/s, "
+        << double(singleStats.nodesVisited) / rays.size() << " (" << double(singleStats.primsTested) / rays.size() << ")" << std::endl;
+
+    for (int size = 4; size <= MAX_PACKET_SIZE; size *= 2) {
+        TraversalStats stats;
+        RayPacket packet;
+        int mismatches = 0, incoherent = 0;
+
+        start = Clock::now();
+        for (int it = 0; it < iterations; it++) {
+            for (int y0 = 0; y0 < height; y0 += size) {
+                for (int x0 = 0; x0 < width; x0 += size) {
+                    int x1 = std::min(x0 + size, width), y1 = std::min(y0 + size, height);
+                    scene.camera.generatePacket(x0, y0, x1, y1, packet);
+                    scene.intersectPacket(packet, it == 0 ? &stats : nullptr);
+                    if (it != 0) continue;
+
+                    incoherent += !packet.coherent;
+                    for (int y = y0, i = 0; y < y1; y++) {
+                        for (int x = x0; x < x1; x++, i++) {
+                            const HitRecord& a = packet.hits[i];
+                            const HitRecord& b = single[y * width + x];
+                            mismatches += a.primIdx != b.primIdx || a.instanceIdx != b.instanceIdx || a.t != b.t;
+                        }
+                    }
+                }
+            }
+        }
+        double packetTime = secondsSince(start);
+
+        std::cout << "  " << size << "x" << size << " packets:            " << numRays / packetTime / 1e6 << " Mrays/s, "
+            << double(stats.nodesVisited) / rays.size() << " (" << double(stats.primsTested) / rays.size() << ")";
+        if (incoherent) std::cout << ", " << incoherent << " traced as single rays";
+        std::cout << std::endl;
+        if (mismatches)
+            std::cout << "  WARNING: " << mismatches << " rays disagree with single-ray traversal" << std::endl;
+    }
+}
+
+struct TextureSample {
+    int texture;
+    Vector2f uv, dUVdx, dUVdy;
+};
+
+static double fetchSeconds(std::vector<Texture>& textures, const std::vector<TextureSample>& samples, int iterations, bool trilinear, Vector3f& sum)
+{
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto& s : samples) {
+            Texture& texture = textures[s.texture];
+            sum += trilinear ? texture.trilinearFetch(s.uv.x, s.uv.y, s.dUVdx, s.dUVdy) : texture.bilinearFetch(s.uv.x, s.uv.y, -1, -1);
+        }
+    }
+    return secondsSince(start);
+}
+
+// Bilinear and trilinear fetches with the scene's diffuse textures reloaded in every layout and compression. The camera
+// samples follow the image; the column walks step down the texture one texel at a time, which is the
+// worst case for scanline order.
+static void benchTextureFetch(Scene& scene, int iterations)
+{
+    std::vector<std::string> paths;
+    for (auto& surf : scene.surfaces)
+        if (!surf.diffuseTexturePath.empty() && std::find(paths.begin(), paths.end(), surf.diffuseTexturePath) == paths.end())
+            paths.push_back(surf.diffuseTexturePath);
+
+    if (paths.empty()) {
+        std::cout << "texture fetches: no textured surfaces" << std::endl;
+        return;
+    }
+
+    std::vector<TextureSample> cameraSamples, columnSamples;
+    for (int y = 0; y < scene.imageResolution.y; y++) {
+        for (int x = 0; x < scene.imageResolution.x; x++) {
+            Ray ray = scene.camera.generateRay(x, y);
+            Interaction si = scene.rayIntersect(ray);
+            if (!si.didIntersect || si.intersected_on_surface->diffuseTexturePath.empty()) continue;
+
+            const Surface* surf = si.intersected_on_surface;
+            const Tri& tri = surf->tris[si.primIdx];
+            TextureSample s;
+            s.texture = int(std::find(paths.begin(), paths.end(), surf->diffuseTexturePath) - paths.begin());
+            s.uv = Texture().getUVCoordinates(si.b1, si.b2, surf->uvs[tri.v[0]], surf->uvs[tri.v[1]], surf->uvs[tri.v[2]]);
+            s.dUVdx = si.dUVdx;
+            s.dUVdy = si.dUVdy;
+            cameraSamples.push_back(s);
+        }
+    }
+
+    Arena probeArena;
+    for (int i = 0; i < int(paths.size()); i++) {
+        Texture::loadLayout = TEXTURE_LAYOUT_SCANLINE;
+        Vector2i res = Texture(paths[i], probeArena).resolution;
+        for (int column = 0; column < 64; column++) {
+            for (int y = 0; y < res.y; y++) {
+                TextureSample s;
+                s.texture = i;
+                s.uv = Vector2f((column + 0.5f) / 64.f, (y + 0.5f) / res.y);
+                s.dUVdx = s.dUVdy = Vector2f(0.f, 0.f);
+                columnSamples.push_back(s);
+            }
+        }
+    }
+
+    std::cout << "texture fetches: " << paths.size() << " textures, " << cameraSamples.size() << " camera samples, "
+        << columnSamples.size() << " column samples (Msamples/s)" << std::endl;
+
+    // Every layout, then every block compression in scanline order; the layouts must fetch exactly what
+    // scanline order does, the compressed formats print their loss and memory instead
+    Vector3f reference[3];
+    size_t referenceMemory = 0;
+    for (int config = 0; config < NUM_TEXTURE_LAYOUTS + NUM_TEXTURE_COMPRESSIONS - 1; config++) {
+        bool compressed = config >= NUM_TEXTURE_LAYOUTS;
+        Arena arena;
+        Texture::loadLayout = compressed ? TEXTURE_LAYOUT_SCANLINE : TextureLayout(config);
+        Texture::loadCompression = compressed ? TextureCompression(config - NUM_TEXTURE_LAYOUTS + 1) : TEXTURE_COMPRESSION_NONE;
+        std::vector<Texture> textures;
+        size_t memory = 0;
+        float psnr = 0.f;
+        for (auto& path : paths) {
+            textures.push_back(Texture(path, arena));
+            memory += textures.back().memoryUsed();
+            psnr += textures.back().compressionPSNR / paths.size();
+        }
+
+        Vector3f sums[3];
+        double camera = fetchSeconds(textures, cameraSamples, iterations, false, sums[0]);
+        double trilinear = fetchSeconds(textures, cameraSamples, iterations, true, sums[1]);
+        double column = fetchSeconds(textures, columnSamples, iterations, false, sums[2]);
+
+        std::string name = compressed ? textureCompressionName(Texture::loadCompression) : textureLayoutName(Texture::loadLayout);
+        std::cout << "  " << name << std::string(10 - name.size(), ' ')
+            << "bilinear " << cameraSamples.size() * double(iterations) / camera / 1e6
+            << ", trilinear " << cameraSamples.size() * double(iterations) / trilinear / 1e6
+            << ", column walk " << columnSamples.size() * double(iterations) / column / 1e6;
+        if (compressed)
+            std::cout << "; " << float(referenceMemory) / memory << "x smaller, texture PSNR " << psnr << " dB";
+        std::cout << std::endl;
+
+        if (config == 0) referenceMemory = memory;
+        if (compressed) continue;
+
+        bool differs = false;
+        for (int i = 0; i < 3; i++) {
+            if (config == 0) reference[i] = sums[i];
+            differs |= sums[i].x != reference[i].x || sums[i].y != reference[i].y || sums[i].z != reference[i].z;
+        }
+        if (differs)
+            std::cout << "  WARNING: fetches differ from the scanline layout" << std::endl;
+    }
+    Texture::loadLayout = TEXTURE_LAYOUT_SCANLINE;
+    Texture::loadCompression = TEXTURE_COMPRESSION_NONE;
+}
+
+// Single against batched nearest and bilinear fetches on the first diffuse texture of the scene, at
+// random uvs so the texels come from all over it
+static void benchTextureSampling(Scene& scene, int iterations)
+{
+    Texture* texture = nullptr;
+    for (auto& surf : scene.surfaces) {
+        if (surf.hasDiffuseTexture()) {
+            texture = &surf.diffuseTexture;
+            break;
+        }
+    }
+    if (!texture) {
+        std::cout << "texture sampling: no textured surfaces" << std::endl;
+        return;
+    }
+
+    const int numBatches = 1 << 14;
+    std::vector<TextureBatch> batches(numBatches);
+    uint32_t state = 12345;
+    auto random = [&]() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / float(1 << 24);
+    };
+    for (auto& batch : batches) {
+        for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+            batch.u[lane] = random();
+            batch.v[lane] = random();
+        }
+    }
+
+    double numSamples = double(numBatches) * TEXTURE_BATCH_SIZE * iterations;
+    std::cout << "texture sampling: " << texture->resolution.x << "x" << texture->resolution.y << " texture, "
+        << numBatches * TEXTURE_BATCH_SIZE << " uvs in batches of " << TEXTURE_BATCH_SIZE << " (Msamples/s)" << std::endl;
+
+    for (int filter = 0; filter < 2; filter++) {
+        std::vector<Vector3f> single(size_t(numBatches) * TEXTURE_BATCH_SIZE);
+        auto start = Clock::now();
+        for (int it = 0; it < iterations; it++) {
+            for (int i = 0; i < numBatches; i++) {
+                for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+                    float u = batches[i].u[lane], v = batches[i].v[lane];
+                    single[i * TEXTURE_BATCH_SIZE + lane] = filter == 0 ? texture->nearestNeighbourFetch(u, v, -1, -1) : texture->bilinearFetch(u, v, -1, -1);
+                }
+            }
+        }
+        double singleTime = secondsSince(start);
+
+        start = Clock::now();
+        for (int it = 0; it < iterations; it++) {
+            for (auto& batch : batches) {
+                if (filter == 0) texture->nearestNeighbourFetch(batch);
+                else texture->bilinearFetch(batch);
+            }
+        }
+        double batchTime = secondsSince(start);
+
+        int mismatches = 0;
+        for (int i = 0; i < numBatches; i++) {
+            for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+                const Vector3f& a = single[i * TEXTURE_BATCH_SIZE + lane];
+                mismatches += a.x != batches[i].r[lane] || a.y != batches[i].g[lane] || a.z != batches[i].b[lane];
+            }
+        }
+
+        std::cout << "  " << (filter == 0 ? "nearest " : "bilinear") << "  one at a time " << numSamples / singleTime / 1e6
+            << ", batched " << numSamples / batchTime / 1e6 << std::endl;
+        if (mismatches) {
+#ifdef __FMA__
+            std::cout << "  (" << mismatches << " samples differ by fused multiply-add rounding)" << std::endl;
+#else
+            std::cout << "  WARNING: " << mismatches << " batched samples differ from single fetches" << std::endl;
+#endif
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: ./bench <scene_config> [iterations]";
+        return 1;
+    }
+
+    int iterations = argc > 2 ? std::max(1, std::stoi(argv[2])) : 4;
+
+    Scene scene(argv[1]);
+
+    benchTraversal(scene, iterations);
+    benchOcclusion(scene, iterations);
+    benchTraversalOrder(scene);
+    benchBoxTests(scene, iterations);
+    benchTriangleTests(scene, iterations);
+    benchPackets(scene, iterations);
+    benchTextureFetch(scene, iterations);
+    benchTextureSampling(scene, iterations);
+
+    return 0;
+}
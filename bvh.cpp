@@ -0,0 +1,88 @@
+#include "bvh.h"
+#include "parallel.h"
+
+BVHSettings bvhSettings;
+
+bool parseBVHBuilder(std::string name, BVHBuilder& builder)
+{
+    if (name == "midpoint") builder = BVH_MIDPOINT;
+    else if (name == "sah") builder = BVH_SAH;
+    else if (name == "lbvh") builder = BVH_LBVH;
+    else return false;
+
+    return true;
+}
+
+std::string bvhBuilderName(BVHBuilder builder)
+{
+    switch (builder) {
+    case BVH_MIDPOINT: return "midpoint";
+    case BVH_SAH: return "sah";
+    case BVH_LBVH: return "lbvh";
+    default: return "unknown";
+    }
+}
+
+float computeSAHCost(const BVHNode* nodes, int numNodes)
+{
+    if (numNodes == 0) return 0.f;
+
+    float rootArea = nodes[0].bbox.area();
+    if (rootArea <= 0.f) return 0.f;
+
+    // Every node below numNodes is reachable from the root, so there is no need to walk the tree
+    float cost = 0.f;
+    for (int i = 0; i < numNodes; i++) {
+        const BVHNode& node = nodes[i];
+        if (node.primCount == 0)
+            cost += bvhSettings.traversalCost * node.bbox.area();
+        else
+            cost += bvhSettings.intersectionCost * node.primCount * node.bbox.area();
+    }
+
+    return cost / rootArea;
+}
+
+void radixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int numBits, int numThreads)
+{
+    const int RADIX = 256;
+    size_t n = keys.size();
+    std::vector<uint64_t> keysOut(n);
+    std::vector<uint32_t> valuesOut(n);
+
+    // Small inputs are not worth a thread each
+    int numChunks = int(std::max<size_t>(1, std::min<size_t>(numThreads, n / 16384)));
+    size_t chunkSize = (n + numChunks - 1) / numChunks;
+    std::vector<size_t> counts(numChunks * RADIX);
+
+    for (int shift = 0; shift < numBits; shift += 8) {
+        std::fill(counts.begin(), counts.end(), 0);
+        parallelFor(numChunks, numThreads, [&](int c) {
+            size_t* count = &counts[c * RADIX];
+            for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+                count[(keys[i] >> shift) & (RADIX - 1)]++;
+        });
+
+        // Turn the counts into write offsets: by digit first, then by chunk within a digit
+        size_t offset = 0;
+        for (int d = 0; d < RADIX; d++) {
+            for (int c = 0; c < numChunks; c++) {
+                size_t count = counts[c * RADIX + d];
+                counts[c * RADIX + d] = offset;
+                offset += count;
+            }
+        }
+
+        parallelFor(numChunks, numThreads, [&](int c) {
+            size_t* next = &counts[c * RADIX];
+            for (size_t i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++) {
+                size_t dst = next[(keys[i] >> shift) & (RADIX - 1)]++;
+                keysOut[dst] = keys[i];
+                valuesOut[dst] = values[i];
+            }
+        });
+
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
@@ -38,5 +38,20 @@ Ray Camera::generateRay(int x, int y)
 
     Vector3f direction = Normalize(pixelCenter - this->from);
 
-    return Ray(this->from, direction);
-}
\ No newline at end of file
+    Ray ray(this->from, direction);
+    ray.dDdx = Normalize(pixelCenter + this->pixelDeltaU - this->from) - direction;
+    ray.dDdy = Normalize(pixelCenter + this->pixelDeltaV - this->from) - direction;
+    ray.hasDifferentials = true;
+
+    return ray;
+}
+
+void Camera::generatePacket(int x0, int y0, int x1, int y1, RayPacket& packet)
+{
+    packet.rays.clear();
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+            packet.rays.push_back(this->generateRay(x, y));
+
+    packet.prepare();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+
+// A read-only view of a whole file. Pages are copy-on-write, so writes through it never reach the file.
+struct MappedFile {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+    void* mappingHandle = nullptr;
+#endif
+
+    bool open(const std::string& path);
+    void close();
+};
+
+/*
+Owns memory that lives exactly as long as a scene or an image: vertex buffers, triangles, BVH nodes,
+triangle blocks, texels and mapped cache files. Allocations are bumped out of large chunks and never
+freed one by one; destroying the arena releases everything at once. Pointers into an arena are plain
+views, so structs holding them copy cheaply and own nothing. Allocation is thread-safe, since surface
+BVHs are built in parallel.
+*/
+class Arena {
+public:
+    // Back chunks with transparent huge pages where the OS supports it (--huge-pages)
+    static bool useHugePages;
+
+    Arena() {}
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // 'size' bytes, aligned to 'alignment' (a power of two no larger than a chunk's alignment)
+    void* allocate(size_t size, size_t alignment = CACHE_LINE_SIZE);
+
+    template <typename T>
+    T* allocate(size_t count)
+    {
+        return (T*)this->allocate(count * sizeof(T), alignof(T) > CACHE_LINE_SIZE ? alignof(T) : CACHE_LINE_SIZE);
+    }
+
+    // 'count' elements copied from 'src' into the arena
+    template <typename T>
+    T* copy(const T* src, size_t count)
+    {
+        T* dst = this->allocate<T>(count);
+        std::copy(src, src + count, dst);
+        this->copied += count * sizeof(T);
+        return dst;
+    }
+
+    // For copies into arena memory made by other means than copy()
+    void countCopy(size_t bytes) { this->copied += bytes; }
+
+    // Keeps 'file' mapped until the arena is destroyed
+    void adopt(MappedFile file);
+    // Frees 'block', which must come from malloc, when the arena is destroyed. Lets image decoders
+    // hand over their output without a copy.
+    void adopt(void* block, size_t size);
+
+    size_t bytesAllocated() const { return allocated; }
+    size_t bytesReserved() const { return reserved; }
+    size_t bytesMapped() const { return mapped; }
+    size_t bytesCopied() const { return copied; }   // Bulk copies made while loading, see copy()
+
+private:
+    struct Chunk {
+        uint8_t* base;
+        size_t size, used;
+    };
+
+    std::vector<Chunk> chunks;
+    std::vector<MappedFile> files;
+    std::vector<void*> blocks;
+    size_t allocated = 0, reserved = 0, mapped = 0;
+    std::atomic<size_t> copied{0};
+    std::mutex lock;
+};
@@ -0,0 +1,727 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstring>
+
+#define SAH_BINS 16
+
+// During builds, nodes with at least this many primitives hand one child subtree to another thread
+#define PARALLEL_BUILD_THRESHOLD 4096
+
+// Branching factor of the surface BVHs after collapsing the binary tree (2, 4 or 8); 2 keeps the
+// binary tree. Set at build time with -DBVH_WIDTH=N.
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 4
+#endif
+
+// Triangles per SoA block in the surface BVH leaves: one AVX2 register, or one SSE register otherwise
+#ifdef __AVX2__
+#define TRI_BLOCK_SIZE 8
+#else
+#define TRI_BLOCK_SIZE 4
+#endif
+
+enum BVHBuilder {
+    BVH_MIDPOINT = 0,   // Split at the spatial midpoint of the longest axis, one primitive per leaf
+    BVH_SAH = 1,        // Binned surface area heuristic
+    BVH_LBVH = 2,       // Linear BVH: triangles sorted by Morton code, split at the highest differing bit
+    NUM_BVH_BUILDERS
+};
+
+// Meshes with more triangles than this get 63-bit Morton codes (21 bits per axis) instead of 30-bit,
+// so large meshes do not pile up many triangles on the same code
+#define LBVH_LONG_CODE_THRESHOLD (1 << 18)
+
+struct BVHSettings {
+    BVHBuilder builder = BVH_SAH;
+    bool builderFromCommandLine = false;    // Set with --bvh, which then wins over the scene file
+    uint32_t maxLeafSize = TRI_BLOCK_SIZE;  // SAH leaves never hold more primitives than this
+    float traversalCost = 1.f;      // Cost of visiting an interior node, relative to...
+    float intersectionCost = 1.f;   // ...the cost of one primitive test
+    bool orderedTraversal = true;   // Visit the nearer child first; otherwise always left before right
+    int buildThreads = 0;           // Threads used to build the BVHs, 0 for every core
+    std::string cacheDirectory;     // Where built surfaces are cached between runs (--cache), empty for none
+};
+
+// Set from the command line in render.cpp, read by the Surface and Scene builders
+extern BVHSettings bvhSettings;
+
+bool parseBVHBuilder(std::string name, BVHBuilder& builder);
+std::string bvhBuilderName(BVHBuilder builder);
+
+// Spreads the low 10 bits of 'v' out to every third bit
+inline uint64_t expandBits10(uint64_t v)
+{
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+// Spreads the low 21 bits of 'v' out to every third bit
+inline uint64_t expandBits21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Morton code of a point given in [0, 1]^3, with 10 or 21 bits per axis
+inline uint64_t mortonCode(Vector3f p, int bitsPerAxis)
+{
+    float cells = float(1 << bitsPerAxis);
+    uint64_t x = uint64_t(std::min(std::max(p.x * cells, 0.f), cells - 1.f));
+    uint64_t y = uint64_t(std::min(std::max(p.y * cells, 0.f), cells - 1.f));
+    uint64_t z = uint64_t(std::min(std::max(p.z * cells, 0.f), cells - 1.f));
+    if (bitsPerAxis == 10)
+        return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+    return (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+}
+
+inline int countLeadingZeros(uint64_t v)
+{
+    if (v == 0) return 64;
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse64(&idx, v);
+    return 63 - int(idx);
+#else
+    return __builtin_clzll(v);
+#endif
+}
+
+/*
+Index of the last key of the left half when the sorted 'codes' in [first, last] are split at the
+highest bit where the codes differ: a binary search for the last code sharing a longer prefix with
+codes[first] than codes[last] does. Ranges of identical codes are split in the middle.
+*/
+inline uint32_t findMortonSplit(const uint64_t* codes, uint32_t first, uint32_t last)
+{
+    uint64_t firstCode = codes[first], lastCode = codes[last];
+    if (firstCode == lastCode) return (first + last) / 2;
+
+    int commonPrefix = countLeadingZeros(firstCode ^ lastCode);
+    uint32_t split = first, step = last - first;
+    do {
+        step = (step + 1) / 2;
+        uint32_t candidate = split + step;
+        if (candidate < last && countLeadingZeros(firstCode ^ codes[candidate]) > commonPrefix)
+            split = candidate;
+    } while (step > 1);
+
+    return split;
+}
+
+// Sorts 'keys' on their low 'numBits' bits, one byte per pass, moving 'values' along. Every pass
+// counts and scatters contiguous chunks of the keys on separate threads; it is stable, so the
+// result does not depend on the thread count.
+void radixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int numBits, int numThreads);
+
+struct SAHSplit {
+    int axis = -1;
+    int bin = 0;                // Primitives whose centroid falls in a bin < this go left
+    float cost = 1e30f;
+    float cmin = 0.f, scale = 0.f;
+    AABB leftBounds, rightBounds;   // Bounds of the two halves, gathered from the bins
+
+    int binOf(Vector3f centroid) const
+    {
+        int b = int((centroid[axis] - cmin) * scale);
+        return std::min(b, SAH_BINS - 1);
+    }
+};
+
+/*
+Finds the cheapest of the SAH_BINS - 1 candidate planes on each axis for the primitives in 'node'.
+'bounds(i)' and 'centroid(i)' return the box and the centroid of the i-th entry of the indirection
+array, for firstPrim <= i < firstPrim + primCount. 'axis' stays -1 if all centroids coincide.
+*/
+template <typename BoundsFn, typename CentroidFn>
+SAHSplit findSAHSplit(const BVHNode& node, BoundsFn bounds, CentroidFn centroid)
+{
+    SAHSplit best;
+
+    AABB centroidBounds;
+    for (uint32_t i = 0; i < node.primCount; i++)
+        centroidBounds.grow(centroid(node.firstPrim + i));
+
+    for (int ax = 0; ax < 3; ax++) {
+        float cmin = centroidBounds.min[ax], cmax = centroidBounds.max[ax];
+        if (cmin == cmax) continue;
+
+        AABB binBounds[SAH_BINS];
+        uint32_t binCount[SAH_BINS] = {0};
+
+        SAHSplit candidate;
+        candidate.axis = ax;
+        candidate.cmin = cmin;
+        candidate.scale = SAH_BINS / (cmax - cmin);
+
+        for (uint32_t i = 0; i < node.primCount; i++) {
+            int b = candidate.binOf(centroid(node.firstPrim + i));
+            binCount[b]++;
+            binBounds[b].grow(bounds(node.firstPrim + i));
+        }
+
+        // Sweep from both sides so every plane is evaluated in O(SAH_BINS)
+        // The boxes are kept so the chosen split also gives the bounds of both children
+        AABB leftBoxes[SAH_BINS - 1], rightBoxes[SAH_BINS - 1];
+        float leftArea[SAH_BINS - 1], rightArea[SAH_BINS - 1];
+        uint32_t leftCount[SAH_BINS - 1], rightCount[SAH_BINS - 1];
+        AABB leftBox, rightBox;
+        uint32_t leftSum = 0, rightSum = 0;
+        for (int b = 0; b < SAH_BINS - 1; b++) {
+            leftSum += binCount[b];
+            leftCount[b] = leftSum;
+            leftBox.grow(binBounds[b]);
+            leftBoxes[b] = leftBox;
+            leftArea[b] = leftBox.area();
+
+            rightSum += binCount[SAH_BINS - 1 - b];
+            rightCount[SAH_BINS - 2 - b] = rightSum;
+            rightBox.grow(binBounds[SAH_BINS - 1 - b]);
+            rightBoxes[SAH_BINS - 2 - b] = rightBox;
+            rightArea[SAH_BINS - 2 - b] = rightBox.area();
+        }
+
+        float nodeArea = node.bbox.area();
+        for (int b = 0; b < SAH_BINS - 1; b++) {
+            if (leftCount[b] == 0 || rightCount[b] == 0) continue;
+
+            float cost = bvhSettings.traversalCost + bvhSettings.intersectionCost *
+                (leftArea[b] * leftCount[b] + rightArea[b] * rightCount[b]) / nodeArea;
+            if (cost < best.cost) {
+                best = candidate;
+                best.bin = b + 1;
+                best.cost = cost;
+                best.leftBounds = leftBoxes[b];
+                best.rightBounds = rightBoxes[b];
+            }
+        }
+    }
+
+    return best;
+}
+
+/*
+Closes the gaps left by a build that places children in implicit slots: the left child of the node
+in slot s right after it, at s + 1, and the right child at s + 2 * (left primitive count), which
+leaves room for any left subtree. Slots then follow a depth-first, left-first order, so nodes only
+move down and are renumbered in place. Returns the number of nodes.
+*/
+inline int compactBVH(BVHNode* nodes)
+{
+    struct StackEntry {
+        uint32_t slot;
+        uint32_t* parentLink;   // Where the new index goes, in the already moved parent
+    };
+    std::vector<StackEntry> stack = { { 0, nullptr } };
+
+    uint32_t numNodes = 0;
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        uint32_t idx = numNodes++;
+        nodes[idx] = nodes[entry.slot];
+        if (entry.parentLink) *entry.parentLink = idx;
+
+        BVHNode& node = nodes[idx];
+        if (node.primCount != 0) continue;
+
+        stack.push_back({ node.right, &node.right });
+        stack.push_back({ node.left, &node.left });
+    }
+    return numNodes;
+}
+
+// Entries the traversal stacks hold without allocating. A binary walk holds at most one entry per level
+// below the root plus one, so trees up to this deep never leave it. No builder bounds the depth (a
+// midpoint split of skewed centroids can go far deeper), so pushes past it spill into a heap vector.
+#define BVH_STACK_SIZE 256
+
+struct TraversalStats {
+    uint64_t nodesVisited = 0;
+    uint64_t primsTested = 0;
+};
+
+// Stands for the top of the tree in 'expand' callbacks of packet traversal
+#define PACKET_ROOT 0xffffffffu
+
+// A box met during packet traversal, with the range of packet rays known to hit it
+struct PacketEntry {
+    AABB box;
+    uint32_t idx = 0;           // Node index, or first primitive for leaves
+    uint32_t primCount = 0;     // 0 for interior nodes
+    int first = 0, last = -1;   // Rays first..last of the packet may hit the box
+    float dist = 0.f;           // Entry distance of ray 'first'
+};
+
+// Children of a binary BVH node for packet traversal; PACKET_ROOT yields the root itself
+inline int expandBVHNode(const BVHNode* nodes, uint32_t nodeIdx, PacketEntry* children)
+{
+    uint32_t childIdx[2] = { 0, 0 };
+    int numChildren = 1;
+    if (nodeIdx != PACKET_ROOT) {
+        childIdx[0] = nodes[nodeIdx].left;
+        childIdx[1] = nodes[nodeIdx].right;
+        numChildren = 2;
+    }
+
+    for (int i = 0; i < numChildren; i++) {
+        const BVHNode& child = nodes[childIdx[i]];
+        children[i].box = child.bbox;
+        children[i].idx = child.primCount != 0 ? child.firstPrim : childIdx[i];
+        children[i].primCount = child.primCount;
+    }
+    return numChildren;
+}
+
+/*
+Walks the tree from the root with an explicit stack. Children are pushed far-to-near so the nearer
+one is visited first, and a node is skipped when its entry distance is already beyond ray.t.
+'leaf(firstPrim, primCount)' tests the primitives of a leaf and may shrink ray.t; returning true
+stops the walk, which is how any-hit queries exit early.
+*/
+template <typename LeafFn>
+void traverseBVH(const BVHNode* nodes, const Ray& ray, LeafFn leaf, TraversalStats* stats = nullptr)
+{
+    struct StackEntry {
+        uint32_t nodeIdx;
+        float dist;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int stackPtr = 0;
+    std::vector<StackEntry> spill;      // Always above the fixed stack, so it is popped first
+
+    float rootDist = nodes[0].bbox.intersects(ray);
+    if (rootDist == NO_INTERSECTION) return;
+    stack[stackPtr++] = { 0, rootDist };
+
+    auto push = [&](const StackEntry& entry) {
+        if (stackPtr < BVH_STACK_SIZE) stack[stackPtr++] = entry;
+        else spill.push_back(entry);
+    };
+
+    while (stackPtr > 0) {
+        StackEntry entry;
+        if (spill.empty()) entry = stack[--stackPtr];
+        else {
+            entry = spill.back();
+            spill.pop_back();
+        }
+
+        // ray.t may have shrunk since this node was pushed
+        if (entry.dist >= ray.t) continue;
+
+        const BVHNode& node = nodes[entry.nodeIdx];
+        if (stats) stats->nodesVisited++;
+
+        if (node.primCount != 0) {
+            if (stats) stats->primsTested += node.primCount;
+            if (leaf(node.firstPrim, node.primCount)) return;
+            continue;
+        }
+
+        StackEntry near = { node.left, nodes[node.left].bbox.intersects(ray) };
+        StackEntry far = { node.right, nodes[node.right].bbox.intersects(ray) };
+        if (bvhSettings.orderedTraversal && far.dist < near.dist) std::swap(near, far);
+
+        if (far.dist != NO_INTERSECTION) push(far);
+        if (near.dist != NO_INTERSECTION) push(near);
+    }
+}
+
+// Smallest power-of-two scale 2^e such that 255 * 2^e covers 'extent'
+inline int quantizationExponent(float extent)
+{
+    int e;
+    std::frexp(extent / 255.f, &e);
+    return std::max(-126, std::min(e, 127));
+}
+
+/*
+A node of an N-wide BVH, 64 bytes for N = 4 and 128 for N = 8 so nodes never straddle cache lines.
+Child bounds are stored as 8-bit offsets from the lower corner of the node, in steps of a per-axis
+power of two, and are rounded outwards so they always contain the real boxes. The offsets are laid
+out one array per axis and side, so a single SIMD sequence tests the ray against all N children.
+Unused slots hold an inverted box that no ray hits.
+*/
+template <int N>
+struct WideBVHNode {
+    static_assert(N % 4 == 0, "wide BVH nodes are tested four children at a time");
+
+    float origin[3];                // Lower corner of the union of the child boxes
+    uint32_t child[N];              // Index of the child node, or of the first primitive for leaves
+    uint16_t primCount[N];          // 0 for interior children
+    int8_t exponent[3];             // Child bounds are origin + q * 2^exponent on each axis
+    uint8_t qmin[3][N], qmax[3][N];
+    uint8_t pad[64 - (15 + 12 * N) % 64];
+
+    WideBVHNode()
+    {
+        // Checked here rather than next to the N % 4 assert, where the type is still incomplete
+        static_assert(sizeof(WideBVHNode) % 64 == 0, "wide BVH nodes must fill whole cache lines");
+
+        for (int ax = 0; ax < 3; ax++) {
+            origin[ax] = 0.f;
+            exponent[ax] = 0;
+            for (int i = 0; i < N; i++) {
+                qmin[ax][i] = 255;
+                qmax[ax][i] = 0;
+            }
+        }
+        for (int i = 0; i < N; i++) {
+            child[i] = 0;
+            primCount[i] = 0;
+        }
+    }
+
+    // 2^exponent, built from the bits directly since this runs for every node visit
+    float scale(int ax) const
+    {
+        uint32_t bits = uint32_t(exponent[ax] + 127) << 23;
+        float s;
+        std::memcpy(&s, &bits, sizeof(float));
+        return s;
+    }
+
+    // Quantizes the boxes of the first 'numChildren' slots against their union
+    void setBounds(const AABB* boxes, int numChildren)
+    {
+        AABB bounds;
+        for (int i = 0; i < numChildren; i++)
+            bounds.grow(boxes[i]);
+
+        for (int ax = 0; ax < 3; ax++) {
+            origin[ax] = bounds.min[ax];
+
+            // Flat boxes still get a step well above the float spacing at the origin, so that the
+            // inverted boxes of unused slots stay inverted after dequantization
+            float extent = std::max(bounds.max[ax] - bounds.min[ax], std::max(std::abs(origin[ax]) * 1e-5f, 1e-30f));
+            for (int e = quantizationExponent(extent); e <= 127; e++) {
+                exponent[ax] = e;
+                if (quantizeAxis(ax, boxes, numChildren)) break;
+            }
+        }
+    }
+
+    // Rounds every box outwards on one axis; false if the scale is too fine for 8 bits
+    bool quantizeAxis(int ax, const AABB* boxes, int numChildren)
+    {
+        float s = this->scale(ax);
+        for (int i = 0; i < numChildren; i++) {
+            // Checked against the dequantized value itself, so rounding in the division cannot shrink a box
+            int lo = std::max(0, std::min(255, int(std::floor((boxes[i].min[ax] - origin[ax]) / s))));
+            while (lo > 0 && origin[ax] + lo * s > boxes[i].min[ax]) lo--;
+
+            int hi = std::max(0, std::min(255, int(std::ceil((boxes[i].max[ax] - origin[ax]) / s))));
+            while (hi < 255 && origin[ax] + hi * s < boxes[i].max[ax]) hi++;
+            if (origin[ax] + hi * s < boxes[i].max[ax]) return false;
+
+            qmin[ax][i] = lo;
+            qmax[ax][i] = hi;
+        }
+        return true;
+    }
+
+    // Writes the dequantized boxes of the used slots for packet traversal and returns how many there are
+    int expand(PacketEntry* children) const
+    {
+        int numChildren = 0;
+        for (int i = 0; i < N; i++) {
+            if (qmin[0][i] > qmax[0][i]) continue;
+
+            PacketEntry& entry = children[numChildren++];
+            for (int ax = 0; ax < 3; ax++) {
+                entry.box.min[ax] = origin[ax] + qmin[ax][i] * scale(ax);
+                entry.box.max[ax] = origin[ax] + qmax[ax][i] * scale(ax);
+            }
+            entry.idx = child[i];
+            entry.primCount = primCount[i];
+        }
+        return numChildren;
+    }
+
+    // Writes the entry distance of every child box into 'dist', NO_INTERSECTION where the ray misses
+    // it or only reaches it beyond ray.t. Same slab test as AABB::intersects, one lane per child.
+    void intersect(const Ray& ray, float* dist) const
+    {
+        // The sign bits pick the near and far plane arrays once for all children
+        const uint8_t* nearX = ray.sign[0] ? qmax[0] : qmin[0];
+        const uint8_t* farX = ray.sign[0] ? qmin[0] : qmax[0];
+        const uint8_t* nearY = ray.sign[1] ? qmax[1] : qmin[1];
+        const uint8_t* farY = ray.sign[1] ? qmin[1] : qmax[1];
+        const uint8_t* nearZ = ray.sign[2] ? qmax[2] : qmin[2];
+        const uint8_t* farZ = ray.sign[2] ? qmin[2] : qmax[2];
+
+#if defined(__AVX2__)
+        if (N % 8 == 0) {
+            // Plane distance along the ray: (q * scale + (origin - ray.o)) / ray.d
+            __m256 bx = _mm256_set1_ps(origin[0] - ray.o.x), by = _mm256_set1_ps(origin[1] - ray.o.y), bz = _mm256_set1_ps(origin[2] - ray.o.z);
+            __m256 sx = _mm256_set1_ps(scale(0)), sy = _mm256_set1_ps(scale(1)), sz = _mm256_set1_ps(scale(2));
+            __m256 ix = _mm256_set1_ps(ray.invD.x), iy = _mm256_set1_ps(ray.invD.y), iz = _mm256_set1_ps(ray.invD.z);
+            __m256 t = _mm256_set1_ps(ray.t), zero = _mm256_setzero_ps(), miss = _mm256_set1_ps(NO_INTERSECTION);
+
+            auto plane = [](const uint8_t* q, __m256 b, __m256 s, __m256 inv) {
+                __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)q)));
+                return _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(v, s), b), inv);
+            };
+
+            for (int k = 0; k < N; k += 8) {
+                __m256 tmin = plane(nearX + k, bx, sx, ix), tmax = plane(farX + k, bx, sx, ix);
+                tmin = _mm256_max_ps(tmin, plane(nearY + k, by, sy, iy));
+                tmax = _mm256_min_ps(tmax, plane(farY + k, by, sy, iy));
+                tmin = _mm256_max_ps(tmin, plane(nearZ + k, bz, sz, iz));
+                tmax = _mm256_min_ps(tmax, plane(farZ + k, bz, sz, iz));
+
+                __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmax, tmin, _CMP_GE_OQ),
+                    _mm256_and_ps(_mm256_cmp_ps(tmin, t, _CMP_LT_OQ), _mm256_cmp_ps(tmax, zero, _CMP_GT_OQ)));
+                _mm256_storeu_ps(dist + k, _mm256_blendv_ps(miss, tmin, hit));
+            }
+            return;
+        }
+#endif
+#ifdef USE_SSE
+        // Plane distance along the ray: (q * scale + (origin - ray.o)) / ray.d
+        __m128 bx = _mm_set1_ps(origin[0] - ray.o.x), by = _mm_set1_ps(origin[1] - ray.o.y), bz = _mm_set1_ps(origin[2] - ray.o.z);
+        __m128 sx = _mm_set1_ps(scale(0)), sy = _mm_set1_ps(scale(1)), sz = _mm_set1_ps(scale(2));
+        __m128 ix = _mm_set1_ps(ray.invD.x), iy = _mm_set1_ps(ray.invD.y), iz = _mm_set1_ps(ray.invD.z);
+        __m128 t = _mm_set1_ps(ray.t), zero = _mm_setzero_ps(), miss = _mm_set1_ps(NO_INTERSECTION);
+
+        auto plane = [](const uint8_t* q, __m128 b, __m128 s, __m128 inv) {
+            int32_t bytes;
+            std::memcpy(&bytes, q, 4);
+            __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), _mm_setzero_si128());
+            v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+            return _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), s), b), inv);
+        };
+
+        for (int k = 0; k < N; k += 4) {
+            __m128 tmin = plane(nearX + k, bx, sx, ix), tmax = plane(farX + k, bx, sx, ix);
+            tmin = _mm_max_ps(tmin, plane(nearY + k, by, sy, iy));
+            tmax = _mm_min_ps(tmax, plane(farY + k, by, sy, iy));
+            tmin = _mm_max_ps(tmin, plane(nearZ + k, bz, sz, iz));
+            tmax = _mm_min_ps(tmax, plane(farZ + k, bz, sz, iz));
+
+            __m128 hit = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_and_ps(_mm_cmplt_ps(tmin, t), _mm_cmpgt_ps(tmax, zero)));
+            _mm_storeu_ps(dist + k, _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, miss)));
+        }
+#else
+        float sx = scale(0), sy = scale(1), sz = scale(2);
+        float bx = origin[0] - ray.o.x, by = origin[1] - ray.o.y, bz = origin[2] - ray.o.z;
+        for (int i = 0; i < N; i++) {
+            float tmin = (nearX[i] * sx + bx) * ray.invD.x, tmax = (farX[i] * sx + bx) * ray.invD.x;
+            tmin = std::max(tmin, (nearY[i] * sy + by) * ray.invD.y), tmax = std::min(tmax, (farY[i] * sy + by) * ray.invD.y);
+            tmin = std::max(tmin, (nearZ[i] * sz + bz) * ray.invD.z), tmax = std::min(tmax, (farZ[i] * sz + bz) * ray.invD.z);
+            dist[i] = (tmax >= tmin && tmin < ray.t && tmax > 0) ? tmin : NO_INTERSECTION;
+        }
+#endif
+    }
+};
+
+// Collapses the subtree of the binary BVH below 'nodeIdx' into wide nodes appended to 'wide' and
+// returns the index of the first one. The interior child with the largest surface area is opened
+// up until the node has N children or only leaves are left. Nodes are built in a vector and copied
+// into cache-line aligned memory by the caller once the count is known.
+template <int N>
+uint32_t collapseBVH(const BVHNode* nodes, uint32_t nodeIdx, std::vector<WideBVHNode<N>>& wide)
+{
+    uint32_t wideIdx = wide.size();
+    wide.push_back(WideBVHNode<N>());
+
+    uint32_t children[N];
+    int numChildren = 0;
+    if (nodes[nodeIdx].primCount != 0) {
+        // A single-leaf tree still gets a wide root, with one child
+        children[numChildren++] = nodeIdx;
+    }
+    else {
+        children[numChildren++] = nodes[nodeIdx].left;
+        children[numChildren++] = nodes[nodeIdx].right;
+    }
+
+    while (numChildren < N) {
+        int open = -1;
+        float openArea = -1.f;
+        for (int i = 0; i < numChildren; i++) {
+            const BVHNode& child = nodes[children[i]];
+            if (child.primCount == 0 && child.bbox.area() > openArea) {
+                open = i;
+                openArea = child.bbox.area();
+            }
+        }
+        if (open == -1) break;
+
+        uint32_t opened = children[open];
+        children[open] = nodes[opened].left;
+        children[numChildren++] = nodes[opened].right;
+    }
+
+    AABB boxes[N];
+    for (int i = 0; i < numChildren; i++)
+        boxes[i] = nodes[children[i]].bbox;
+    wide[wideIdx].setBounds(boxes, numChildren);
+
+    for (int i = 0; i < numChildren; i++) {
+        const BVHNode& child = nodes[children[i]];
+        if (child.primCount > 0xffff) {
+            std::cerr << "BVH leaf with " << child.primCount << " primitives does not fit a wide node." << std::endl;
+            exit(1);
+        }
+
+        uint32_t childIdx = child.primCount != 0 ? child.firstPrim : collapseBVH(nodes, children[i], wide);
+        wide[wideIdx].child[i] = childIdx;
+        wide[wideIdx].primCount[i] = child.primCount;
+    }
+
+    return wideIdx;
+}
+
+/*
+Same walk as traverseBVH over an N-wide tree: all children of a node are tested at once, and the ones
+that are hit are pushed far-to-near. Leaves are pushed like nodes so they are also visited in order
+and skipped once ray.t has moved in front of them.
+*/
+template <int N, typename LeafFn>
+void traverseWideBVH(const WideBVHNode<N>* nodes, const Ray& ray, LeafFn leaf, TraversalStats* stats = nullptr)
+{
+    struct StackEntry {
+        uint32_t idx;           // Node index, or first primitive for leaves
+        uint32_t primCount;     // 0 for interior nodes
+        float dist;
+    };
+    // Every level of the wide tree adds at most N - 1 entries, and it has no more levels than the binary one
+    StackEntry stack[BVH_STACK_SIZE * (N - 1)];
+    int stackPtr = 0;
+    std::vector<StackEntry> spill;      // Always above the fixed stack, so it is popped first
+
+    stack[stackPtr++] = { 0, 0, -1e30f };
+
+    float dist[N];
+    while (stackPtr > 0) {
+        StackEntry entry;
+        if (spill.empty()) entry = stack[--stackPtr];
+        else {
+            entry = spill.back();
+            spill.pop_back();
+        }
+
+        // ray.t may have shrunk since this entry was pushed
+        if (entry.dist >= ray.t) continue;
+
+        if (stats) stats->nodesVisited++;
+
+        if (entry.primCount != 0) {
+            if (stats) stats->primsTested += entry.primCount;
+            if (leaf(entry.idx, entry.primCount)) return;
+            continue;
+        }
+
+        const WideBVHNode<N>& node = nodes[entry.idx];
+        node.intersect(ray, dist);
+
+        // Insertion sort of the hit children by decreasing distance, so the nearest ends up on top.
+        // Unordered, the first child ends up on top.
+        StackEntry hits[N];
+        int numHits = 0;
+        for (int i = N - 1; i >= 0; i--) {
+            if (dist[i] == NO_INTERSECTION) continue;
+
+            StackEntry hit = { node.child[i], node.primCount[i], dist[i] };
+            int j = numHits++;
+            if (bvhSettings.orderedTraversal) {
+                for (; j > 0 && hits[j - 1].dist < hit.dist; j--)
+                    hits[j] = hits[j - 1];
+            }
+            hits[j] = hit;
+        }
+
+        for (int i = 0; i < numHits; i++) {
+            if (stackPtr < BVH_STACK_SIZE * (N - 1)) stack[stackPtr++] = hits[i];
+            else spill.push_back(hits[i]);
+        }
+    }
+}
+
+/*
+Ranged packet traversal: each entry carries the first and last ray of the packet that hit its box,
+and a child only scans that range, from both ends, for rays that hit it. Coherent rays mostly agree,
+so a node usually costs one box test per child rather than one per ray, and the interval test drops
+children that no ray can reach without scanning at all. Children are pushed far-to-near by the
+entry distance of their first ray. Rays shrink their own ray.t as leaves are tested, which culls
+them from later box tests.
+'expand(idx, children)' writes the children of interior node 'idx' (the top of the tree for
+PACKET_ROOT) and returns how many there are. 'leaf(entry)' tests rays entry.first..entry.last
+against the primitives of a leaf. The packet must be coherent.
+*/
+template <int MaxChildren, typename ExpandFn, typename LeafFn>
+void traversePacketBVH(RayPacket& packet, int first, int last, ExpandFn expand, LeafFn leaf, TraversalStats* stats = nullptr)
+{
+    // Entries hold a box, so a fixed array would be constructed on every call. The stack is kept per
+    // thread instead; a nested call (a surface traversed from a scene leaf) pushes above its caller.
+    thread_local std::vector<PacketEntry> stack;
+    size_t base = stack.size();
+
+    PacketEntry root;
+    root.idx = PACKET_ROOT;
+    root.first = first;
+    root.last = last;
+    stack.push_back(root);
+
+    PacketEntry children[MaxChildren];
+    while (stack.size() > base) {
+        PacketEntry entry = stack.back();
+        stack.pop_back();
+
+        if (stats) stats->nodesVisited++;
+
+        if (entry.primCount != 0) {
+            if (stats) stats->primsTested += uint64_t(entry.primCount) * (entry.last - entry.first + 1);
+            leaf(entry);
+            continue;
+        }
+
+        int numChildren = expand(entry.idx, children);
+
+        // Same insertion sort as traverseWideBVH, on the distance of each child's first ray
+        PacketEntry hits[MaxChildren];
+        int numHits = 0;
+        for (int i = numChildren - 1; i >= 0; i--) {
+            PacketEntry& child = children[i];
+            // With a single ray left the scan below is one box test, cheaper than the interval test
+            if (entry.first != entry.last && !packet.mayHit(child.box)) continue;
+
+            child.first = entry.first;
+            for (; child.first <= entry.last; child.first++) {
+                child.dist = child.box.intersects(packet.rays[child.first]);
+                if (child.dist != NO_INTERSECTION) break;
+            }
+            if (child.first > entry.last) continue;
+
+            child.last = entry.last;
+            while (child.last > child.first && child.box.intersects(packet.rays[child.last]) == NO_INTERSECTION)
+                child.last--;
+
+            int j = numHits++;
+            if (bvhSettings.orderedTraversal) {
+                for (; j > 0 && hits[j - 1].dist < child.dist; j--)
+                    hits[j] = hits[j - 1];
+            }
+            hits[j] = child;
+        }
+
+        for (int i = 0; i < numHits; i++)
+            stack.push_back(hits[i]);
+    }
+}
+
+// SAH cost of a built tree, normalised by the area of the root. Lower is better.
+float computeSAHCost(const BVHNode* nodes, int numNodes);
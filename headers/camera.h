@@ -18,4 +18,7 @@ struct Camera {
     Camera(Vector3f from, Vector3f to, Vector3f up, float fieldOfView, Vector2i imageResolution);
 
     Ray generateRay(int x, int y);
+
+    // Camera rays of the pixels [x0, x1) x [y0, y1), row by row
+    void generatePacket(int x0, int y0, int x1, int y1, RayPacket& packet);
 };
\ No newline at end of file
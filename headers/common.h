@@ -11,33 +11,112 @@
 
 #include "json/include/nlohmann/json.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #define M_PI 3.14159263f
 extern int option;
 
+#define CACHE_LINE_SIZE 64
+
+// 'size' bytes aligned to 'alignment' (a power of two); release with freeAligned
+inline void* mallocAligned(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size) != 0) return nullptr;
+    return ptr;
+#endif
+}
+
+inline void freeAligned(void* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Direction components smaller than this are treated as this (keeping the sign) when taking the reciprocal
+#define RAY_MIN_DIRECTION 1e-20f
+
 struct Ray {
     Vector3f o, d;
+    Vector3f invD;          // 1 / d, finite in every component
+    int sign[3];            // 1 where the direction component is negative
     float t = 1e30f;
     float tmax = 1e30f;
 
+    // How the direction changes to the rays through the next pixel in x and in y, used to size the
+    // texture footprint. Only camera rays have them; all of them start at the same origin.
+    Vector3f dDdx, dDdy;
+    bool hasDifferentials = false;
 
     Ray(Vector3f origin, Vector3f direction, float t = 1e30f, float tmax = 1e30f)
-        : o(origin), d(direction), t(t), tmax(tmax) {};
+        : o(origin), d(direction), t(t), tmax(tmax)
+    {
+        // Axis-parallel rays get a huge but finite reciprocal, so slab tests never compute 0 * inf
+        for (int i = 0; i < 3; i++) {
+            float di = std::abs(d[i]) < RAY_MIN_DIRECTION ? std::copysign(RAY_MIN_DIRECTION, d[i]) : d[i];
+            invD[i] = 1.f / di;
+            sign[i] = invD[i] < 0.f;
+        }
+    };
 };
 
+#define NO_INTERSECTION 1e30f
+
 struct AABB {
     Vector3f min = Vector3f(1e30f, 1e30f, 1e30f);
     Vector3f max = Vector3f(-1e30f, -1e30f, -1e30f);
-    Vector3f centroid = Vector3f(0.f, 0.f, 0.f);
 
-    bool intersects(Ray ray)
+    // Returns the distance at which the ray enters the box (negative if it starts inside),
+    // or NO_INTERSECTION if it misses the box or only reaches it beyond ray.t
+    float intersects(const Ray& ray) const
     {
-        float tx1 = (min.x - ray.o.x) / ray.d.x, tx2 = (max.x - ray.o.x) / ray.d.x;
-        float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
-        float ty1 = (min.y - ray.o.y) / ray.d.y, ty2 = (max.y - ray.o.y) / ray.d.y;
-        tmin = std::max(tmin, std::min(ty1, ty2)), tmax = std::min(tmax, std::max(ty1, ty2));
-        float tz1 = (min.z - ray.o.z) / ray.d.z, tz2 = (max.z - ray.o.z) / ray.d.z;
-        tmin = std::max(tmin, std::min(tz1, tz2)), tmax = std::min(tmax, std::max(tz1, tz2));
-        return tmax >= tmin && tmin < ray.t && tmax > 0;
+        // The sign bits pick the near and far plane of each slab directly, so there is no min/max per axis
+        // and no division; compilers turn the selects into conditional moves
+        float tmin = ((ray.sign[0] ? max.x : min.x) - ray.o.x) * ray.invD.x;
+        float tmax = ((ray.sign[0] ? min.x : max.x) - ray.o.x) * ray.invD.x;
+        float tymin = ((ray.sign[1] ? max.y : min.y) - ray.o.y) * ray.invD.y;
+        float tymax = ((ray.sign[1] ? min.y : max.y) - ray.o.y) * ray.invD.y;
+        tmin = std::max(tmin, tymin), tmax = std::min(tmax, tymax);
+        float tzmin = ((ray.sign[2] ? max.z : min.z) - ray.o.z) * ray.invD.z;
+        float tzmax = ((ray.sign[2] ? min.z : max.z) - ray.o.z) * ray.invD.z;
+        tmin = std::max(tmin, tzmin), tmax = std::min(tmax, tzmax);
+        if (tmax >= tmin && tmin < ray.t && tmax > 0) return tmin;
+        return NO_INTERSECTION;
+    }
+
+    void grow(Vector3f p)
+    {
+        min = Vector3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vector3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    void grow(const AABB& other)
+    {
+        min = Vector3f(std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z));
+        max = Vector3f(std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z));
+    }
+
+    Vector3f centroid() const { return (min + max) / 2.f; }
+
+    // Surface area, used by the SAH. Empty boxes have zero area.
+    float area() const
+    {
+        Vector3f e = max - min;
+        if (e.x < 0 || e.y < 0 || e.z < 0) return 0.f;
+        return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
     }
 };
 
@@ -48,20 +127,92 @@ struct BVHNode {
 };
 
 struct Tri {
-    Vector3f v1, v2, v3;
-    Vector2f uv1, uv2, uv3;
-    Vector3f normal;
-    Vector3f centroid;
-    
-    AABB bbox;
+    uint32_t v[3];  // Indices into Surface::vertices, normals and uvs
 };
 
 struct Surface;
 
+#define NO_HIT 0xffffffffu
+
+// Compact record of the closest hit found so far, the only thing written during traversal
+struct HitRecord {
+    float t = 1e30f;
+    uint32_t primIdx = NO_HIT;  // Index into Surface::tris
+    uint32_t instanceIdx = 0;   // Index into Scene::instances
+    float b1 = 0.f, b2 = 0.f;   // Barycentric weights of v2 and v3 (v1 gets 1 - b1 - b2)
+
+    bool didIntersect() const { return primIdx != NO_HIT; }
+};
+
+// Packets cover at most MAX_PACKET_SIZE x MAX_PACKET_SIZE pixels
+#define MAX_PACKET_SIZE 8
+
+/*
+Camera rays traced together through the BVHs, with the closest hit of each. Bounds on the origins
+and reciprocal directions of all rays give an interval test that culls a box for the whole packet
+at once. It only holds when every ray has the same direction sign on each axis; packets where that
+fails are not coherent and are traced one ray at a time.
+*/
+struct RayPacket {
+    std::vector<Ray> rays;
+    std::vector<HitRecord> hits;
+
+    Vector3f oMin, oMax, invDMin, invDMax;
+    int sign[3] = {0, 0, 0};
+    bool coherent = false;
+
+    // Clears the hits and computes the bounds, once the rays have been filled in
+    void prepare()
+    {
+        hits.assign(rays.size(), HitRecord());
+        coherent = !rays.empty();
+        if (!coherent) return;
+
+        oMin = oMax = rays[0].o;
+        invDMin = invDMax = rays[0].invD;
+        for (int i = 0; i < 3; i++) sign[i] = rays[0].sign[i];
+
+        for (auto& ray : rays) {
+            for (int i = 0; i < 3; i++) {
+                oMin[i] = std::min(oMin[i], ray.o[i]), oMax[i] = std::max(oMax[i], ray.o[i]);
+                invDMin[i] = std::min(invDMin[i], ray.invD[i]), invDMax[i] = std::max(invDMax[i], ray.invD[i]);
+                coherent = coherent && ray.sign[i] == sign[i];
+            }
+        }
+    }
+
+    // False only if no ray of the packet can hit the box. Each slab gives an interval of entry and
+    // exit distances over all rays; the box is missed when the latest possible entry on some axis
+    // comes after the earliest possible exit on another, or every exit is behind the origins.
+    // Only valid for coherent packets.
+    bool mayHit(const AABB& box) const
+    {
+        float tmin = -1e30f, tmax = 1e30f;
+        for (int i = 0; i < 3; i++) {
+            float nearPlane = sign[i] ? box.max[i] : box.min[i];
+            float farPlane = sign[i] ? box.min[i] : box.max[i];
+
+            // Extremes of (plane - o) * invD over the box of origins and reciprocal directions
+            float n1 = (nearPlane - oMin[i]) * invDMin[i], n2 = (nearPlane - oMin[i]) * invDMax[i];
+            float n3 = (nearPlane - oMax[i]) * invDMin[i], n4 = (nearPlane - oMax[i]) * invDMax[i];
+            float f1 = (farPlane - oMin[i]) * invDMin[i], f2 = (farPlane - oMin[i]) * invDMax[i];
+            float f3 = (farPlane - oMax[i]) * invDMin[i], f4 = (farPlane - oMax[i]) * invDMax[i];
+            tmin = std::max(tmin, std::min(std::min(n1, n2), std::min(n3, n4)));
+            tmax = std::min(tmax, std::max(std::max(f1, f2), std::max(f3, f4)));
+        }
+        return tmax >= tmin && tmax > 0;
+    }
+};
+
+// Full surface data at a hit, built once from the winning HitRecord
 struct Interaction {
     Vector3f p, n;
-    Tri triangleIntersected; // Let's see if this works
-    Surface* intersected_on_surface; // Pointer to which surface it intersected on
+    Surface* intersected_on_surface = nullptr; // Pointer to which surface it intersected on
+    uint32_t primIdx = 0;   // Index into Surface::tris of the triangle that was hit
+    float b1 = 0.f, b2 = 0.f;   // Barycentric weights of v2 and v3 at the hit (v1 gets 1 - b1 - b2)
     float t = 1e30f;
     bool didIntersect = false;
+
+    // Change of the texture coordinates from this pixel to the next in x and y; zero without ray differentials
+    Vector2f dUVdx, dUVdy;
 };
@@ -17,4 +17,4 @@ struct Light {
 };
 
 // It's just numbers so I don't think it should be problem to just be able to load them. Yeah, I think so.
-std::vector<Light> loadLights(nlohmann::json sceneConfig);
\ No newline at end of file
+std::vector<Light> loadLights(nlohmann::json& sceneConfig);
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "surface.h"
+
+/*
+On-disk cache of the surfaces loaded from one OBJ file, with their finished BVHs. The file holds the
+vertex buffers, triangles, binary nodes, wide nodes and triangle blocks exactly as they sit in memory,
+each section 64-byte aligned, so loading maps the file and points the surfaces into it with no parsing
+or copying. A file is named after its key: a hash of the OBJ and MTL contents, the builder settings and
+the in-memory layouts, so any change to those simply misses the cache.
+*/
+
+#define MESH_CACHE_VERSION 2
+
+// 64-bit hash of 'size' bytes, chained through 'seed'; also keys the texture tile files
+uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t seed);
+
+// Key of the cache entry of an OBJ file under the current BVH settings; 0 if the file cannot be read
+uint64_t meshCacheKey(const std::string& pathToObj);
+std::string meshCachePath(uint64_t key);
+
+// Points 'surfaces' into the cache file for 'key'. Returns false, leaving 'surfaces' empty, if there
+// is no valid entry. The mapping is handed to 'arena', which keeps it open; textures come from 'textures'.
+bool loadMeshCache(uint64_t key, bool isLight, uint32_t shapeIdx, std::vector<Surface>& surfaces, Arena& arena, TextureRegistry& textures);
+
+// Writes surfaces with built BVHs as the entry for 'key'
+bool saveMeshCache(uint64_t key, const Surface* surfaces, uint32_t numSurfaces);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+
+// A small work-stealing scheduler. Every worker owns a queue of task indices;
+// it pops from the front of its own queue and, once that runs dry, steals from
+// the back of the other workers' queues.
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<int> tasks;
+
+    bool popFront(int& task);
+    bool popBack(int& task);
+};
+
+int defaultThreadCount();
+
+// Claims up to 'wanted' threads to start, as long as fewer than numThreads - 1 claimed threads are
+// running across all callers; returns how many it got, which the caller gives back with releaseThreads
+// once they exit. parallelFor, parallelInvoke and the texture decoders all draw on this one budget.
+int reserveThreads(int wanted, int numThreads);
+void releaseThreads(int count);
+
+// Runs task(i) for every i in [0, numTasks) on numThreads threads, or fewer when nested calls already
+// run some of them (see parallelInvoke).
+// Tasks are dealt out in contiguous runs so neighbouring tiles start on the same worker.
+void parallelFor(int numTasks, int numThreads, const std::function<void(int)>& task);
+
+// Runs a() and b() as a fork-join pair: a() on a new thread while b() runs on this one, as long as
+// reserveThreads grants one; otherwise both run here. Since everything draws on that one budget,
+// recursive builds inside a parallelFor with the same numThreads never run more than numThreads
+// threads, the caller's included.
+void parallelInvoke(int numThreads, const std::function<void()>& a, const std::function<void()>& b);
@@ -2,11 +2,22 @@
 
 #include "scene.h"
 
+#define TILE_SIZE 16
+
+struct Tile {
+    int x0, y0, x1, y1;     // Pixel range [x0, x1) x [y0, y1)
+};
+
 struct Integrator {
-    Integrator(Scene& scene);
+    Integrator(Scene& scene, int numThreads = 1, int packetSize = 0);
 
     long long render();
+    void renderTile(Tile tile);
+    Vector3f shadePixel(const Interaction& si, int x, int y);
 
-    Scene scene;
+    Scene& scene;
+    Arena arena;            // Holds the output image
     Texture outputImage;
-};
\ No newline at end of file
+    int numThreads = 1;
+    int packetSize = 0;     // Camera rays are traced in packetSize x packetSize packets; 0 traces them one at a time
+};
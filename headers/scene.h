@@ -3,10 +3,47 @@
 #include "camera.h"
 #include "surface.h"
 #include "light.h"
+#include "transform.h"
+#include "texturecache.h"
+
+#include <map>
+#include <memory>
+
+/*
+One placement of a surface in the scene. The geometry and BVH of a surface are stored once however
+many instances refer to it; rays are moved into the surface's object space to be intersected.
+Affine maps keep the ray parameter, so distances need no conversion between the two spaces.
+*/
+struct Instance {
+    uint32_t surfaceIdx = 0;
+    Transform objectToWorld, worldToObject;
+    bool identity = true;   // Rays and normals are used as they are
+    AABB bbox;              // World-space bounds
+
+    Ray toObject(const Ray& ray) const
+    {
+        return Ray(worldToObject.point(ray.o), worldToObject.vector(ray.d), ray.t, ray.tmax);
+    }
+};
 
 struct Scene {
+    // Owns all geometry, BVH and texel memory of the scene, which the structs below only point into.
+    // Held by pointer so that moving a Scene leaves those pointers valid; a Scene cannot be copied.
+    std::unique_ptr<Arena> arena = std::make_unique<Arena>();
+    // Tiles of out-of-core textures (--texture-budget); outlives the registry, whose textures read through it
+    std::unique_ptr<TextureTileCache> tileCache;
+    // Every image the surfaces use, decoded once into the arena in the background while the scene loads
+    std::unique_ptr<TextureRegistry> textures = std::make_unique<TextureRegistry>();
+
     std::vector<Surface> surfaces;
-    std::vector<uint32_t> surfaceIdxs;
+    std::vector<Instance> instances;
+    std::vector<uint32_t> instanceIdxs;
+
+    // Surfaces loaded from each OBJ file as (first index, count), so every file is loaded only once
+    std::map<std::string, std::pair<uint32_t, uint32_t>> surfaceRanges;
+
+    // Files that missed the mesh cache, with their keys; written to it once their BVHs are built
+    std::vector<std::pair<std::string, uint64_t>> cacheMisses;
     Camera camera;
     Vector2i imageResolution;
 
@@ -19,14 +56,37 @@ struct Scene {
     Scene() {};
     Scene(std::string sceneDirectory, std::string sceneJson);
     Scene(std::string pathToJson);
-    
-    void parse(std::string sceneDirectory, nlohmann::json sceneConfig);
+
+    // Move-only, like the Surfaces it holds; pass it around by reference
+    Scene(Scene&&) = default;
+    Scene& operator=(Scene&&) = default;
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+
+    void parse(std::string sceneDirectory, nlohmann::json& sceneConfig);
+    void addInstances(std::string surfacePath, const Transform& objectToWorld);
 
     void buildBVH();
+
+    // Rebuilds every surface BVH with each builder and prints build time and tree cost side by side
+    void compareBuilders();
     uint32_t getIdx(uint32_t idx);
     void updateNodeBounds(uint32_t nodeIdx);
     void subdivideNode(uint32_t nodeIdx);
-    void intersectBVH(uint32_t nodeIdx, Ray& ray, Interaction& si);
+    void intersectBVH(Ray& ray, HitRecord& hit, TraversalStats* stats = nullptr);
+    bool intersectInstance(uint32_t instanceIdx, Ray& ray, HitRecord& hit, TraversalStats* stats = nullptr);
+    void intersectInstancePacket(uint32_t instanceIdx, RayPacket& packet, int first, int last, TraversalStats* stats = nullptr);
 
+    // Only reads the scene and the BVH; all traversal state lives in the ray and the interaction,
+    // so this can be called from several render threads at once.
     Interaction rayIntersect(Ray& ray);
+
+    // Closest hits of every ray of the packet, into packet.hits. Packets that are not coherent
+    // fall back to intersectBVH one ray at a time.
+    void intersectPacket(RayPacket& packet, TraversalStats* stats = nullptr);
+    Interaction computeInteraction(const Ray& ray, const HitRecord& hit);
+
+    // Shadow-ray query: true if anything blocks the ray before min(ray.tmax, tmax).
+    // Stops at the first blocker instead of looking for the closest one.
+    bool occluded(Ray ray, float tmax = 1e30f, TraversalStats* stats = nullptr);
 };
\ No newline at end of file
@@ -2,17 +2,56 @@
 
 #include "common.h"
 #include "texture.h"
+#include "bvh.h"
+
+/*
+TRI_BLOCK_SIZE triangles in structure-of-arrays form, laid out for the SIMD intersection kernel.
+Each holds the first vertex and the two edges from it, so Moller-Trumbore needs no subtraction of
+vertices per test. Unused lanes hold a degenerate triangle that is never hit.
+*/
+struct TriBlock {
+    float v1[3][TRI_BLOCK_SIZE];
+    float e1[3][TRI_BLOCK_SIZE], e2[3][TRI_BLOCK_SIZE];
+    uint32_t triIdx[TRI_BLOCK_SIZE];    // Index into Surface::tris, NO_HIT for unused lanes
+
+    TriBlock();
+    void setTriangle(int lane, Vector3f v1, Vector3f v2, Vector3f v3, uint32_t idx);
+
+    // Tests the ray against every triangle of the block. Returns a bit mask of the lanes hit at a
+    // distance in [0, ray.t], with their distances and barycentrics written to 't', 'b1' and 'b2'.
+    int intersect(const Ray& ray, float* t, float* b1, float* b2) const;
+};
 
 struct Surface {
-    std::vector<Vector3f> vertices, normals;
-    std::vector<Vector3i> indices;
-    std::vector<Vector2f> uvs;
+    // Welded vertex buffers, one entry per distinct position/normal/uv combination of the OBJ file.
+    // Either in the scene's arena or in a mapped mesh cache file; the surface owns neither.
+    Vector3f* vertices = nullptr;
+    Vector3f* normals = nullptr;
+    Vector2f* uvs = nullptr;
+    uint32_t numVertices = 0;
 
     BVHNode* nodes;
     int numBVHNodes = 0;
 
-    std::vector<Tri> tris;
+#if BVH_WIDTH > 2
+    // The binary tree collapsed to BVH_WIDTH children per node, cache-line aligned; this is what traversal walks
+    WideBVHNode<BVH_WIDTH>* wideNodes = nullptr;
+    int numWideNodes = 0;
+#endif
+
+    // Triangles as indices into the vertex buffers, allocated the same way
+    Tri* tris = nullptr;
+    uint32_t numTris = 0;
+
+    // Only kept while the BVH is built
     std::vector<uint32_t> triIdxs;
+    std::vector<AABB> triBounds;
+    std::vector<Vector3f> triCentroids;
+
+    // Leaf triangles packed in BVH order, cache-line aligned. Once packed, the firstPrim of a leaf is
+    // the index of its first block rather than a position in triIdxs.
+    TriBlock* triBlocks = nullptr;
+    int numTriBlocks = 0;
     AABB bbox;
 
     bool isLight;
@@ -22,20 +61,51 @@ struct Surface {
     float alpha;
 
     Texture diffuseTexture, alphaTexture;
+    std::string diffuseTexturePath, alphaTexturePath;   // Empty without a texture; kept for the mesh cache
 
-    void buildBVH();
+    // Node, block and wide node memory comes from 'arena'; the build's scratch memory is freed
+    void buildBVH(Arena& arena);
     uint32_t getIdx(uint32_t idx);
     void updateNodeBounds(uint32_t nodeIdx);
     void subdivideNode(uint32_t nodeIdx);
-    void intersectBVH(uint32_t nodeIdx, Ray& ray, Interaction& si);
+    void buildLBVH();
+    void emitLBVH(uint32_t nodeIdx, const uint64_t* codes);
+    void packTriangles(Arena& arena);
+    void intersectBVH(Ray& ray, HitRecord& hit, TraversalStats* stats = nullptr);
+
+    // Closest hit of 'ray' among the triangles of one leaf; true if it improved on 'hit'
+    bool intersectLeaf(Ray& ray, uint32_t firstBlock, uint32_t primCount, HitRecord& hit);
+
+    // Closest hits of rays first..last of a coherent packet, tagged with 'instanceIdx'
+    void intersectPacket(RayPacket& packet, int first, int last, uint32_t instanceIdx, TraversalStats* stats = nullptr);
 
     Interaction rayPlaneIntersect(Ray ray, Vector3f p, Vector3f n);
-    Interaction rayTriangleIntersect(Ray ray, Vector3f v1, Vector3f v2, Vector3f v3, Vector3f n);
-    Interaction rayIntersect(Ray& ray);
+    bool rayTriangleIntersect(const Ray& ray, uint32_t triIdx, HitRecord& hit);
+
+    // Returns true and overwrites 'hit' if a hit closer than ray.t was found; the caller fills in instanceIdx
+    bool rayIntersect(Ray& ray, HitRecord& hit, TraversalStats* stats = nullptr);
+    Interaction computeInteraction(const Ray& ray, const HitRecord& hit);
+
+    // Fills in si.dUVdx and si.dUVdy from the differentials of 'ray', which must be in this surface's space
+    void computeDifferentials(const Ray& ray, const HitRecord& hit, Interaction& si);
+
+    // Any-hit query: stops at the first triangle closer than ray.t
+    bool occluded(const Ray& ray, TraversalStats* stats = nullptr);
 
 // private:     // WHy was this private? I need to see
     bool hasDiffuseTexture();
     bool hasAlphaTexture();
+
+    // Surfaces are moved, never copied: a copy would look independent while sharing every buffer
+    Surface() {}
+    Surface(Surface&&) = default;
+    Surface& operator=(Surface&&) = default;
+    Surface(const Surface&) = delete;
+    Surface& operator=(const Surface&) = delete;
+
+    // A surface sharing this one's geometry and material but with no BVH, to be built separately
+    Surface cloneGeometry() const;
 };
 
-std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx);
\ No newline at end of file
+// Vertex buffers and triangles are allocated from 'arena'; textures are decoded through 'textures', once per path
+std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx, Arena& arena, TextureRegistry& textures);
\ No newline at end of file
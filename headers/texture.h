@@ -1,6 +1,12 @@
 #pragma once
 
 #include "common.h"
+#include "arena.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 enum TextureType {
     UNSIGNED_INTEGER_ALPHA = 0, // RGBA uint32
@@ -8,29 +14,183 @@ enum TextureType {
     NUM_TEXTURE_TYPES
 };
 
+// Order of the texels of an 8-bit texture in memory. Scanline keeps rows one after the other. The tiled
+// layouts store square blocks of texels contiguously, so a bilinear footprint or a run of pixels walking
+// down a column stays within a few cache lines. Morton order interleaves the bits of x and y, which
+// does the same at every scale.
+enum TextureLayout {
+    TEXTURE_LAYOUT_SCANLINE = 0,
+    TEXTURE_LAYOUT_TILED_4,
+    TEXTURE_LAYOUT_TILED_8,
+    TEXTURE_LAYOUT_MORTON,
+    NUM_TEXTURE_LAYOUTS
+};
+
+bool parseTextureLayout(std::string name, TextureLayout& layout);
+std::string textureLayoutName(TextureLayout layout);
+
+// Block compression of 8-bit textures. BC1 stores every 4 x 4 block of texels in 8 bytes: two RGB565
+// endpoint colors and a 2-bit index per texel picking one of four colors evenly spaced between them.
+// That is an eighth of the memory of RGBA8, at the cost of alpha and some color precision. Texels are
+// decoded on every fetch.
+enum TextureCompression {
+    TEXTURE_COMPRESSION_NONE = 0,
+    TEXTURE_COMPRESSION_BC1,
+    NUM_TEXTURE_COMPRESSIONS
+};
+
+bool parseTextureCompression(std::string name, TextureCompression& compression);
+std::string textureCompressionName(TextureCompression compression);
+
+// Lookups filtered together by the batched fetches, one per SIMD lane
+#ifdef __AVX2__
+#define TEXTURE_BATCH_SIZE 8
+#else
+#define TEXTURE_BATCH_SIZE 4
+#endif
+
+// Structure-of-arrays batch for the batched fetches: the caller fills in u and v, the fetch r, g and b
+struct TextureBatch {
+    float u[TEXTURE_BATCH_SIZE], v[TEXTURE_BATCH_SIZE];
+    float r[TEXTURE_BATCH_SIZE], g[TEXTURE_BATCH_SIZE], b[TEXTURE_BATCH_SIZE];
+};
+
+struct TiledTexture;
+class TextureTileCache;
+
+// Enough for a 65536 x 65536 image
+#define MAX_MIP_LEVELS 17
+
+// Texels live in the arena the texture was loaded or allocated into; copies of a Texture share them
 struct Texture {
-    unsigned long long data = 0;
+    // Layout of the 8-bit textures loaded from now on (--texture-layout); images rendered into stay in scanline order
+    static TextureLayout loadLayout;
+    // Block compression of the 8-bit textures loaded from now on (--texture-compression); takes the place of the layout
+    static TextureCompression loadCompression;
+    // Bytes of texture tiles kept in memory when 8-bit textures are read out of core (--texture-budget); 0 loads them whole
+    static size_t tileBudget;
+
+    void* data = nullptr;
     TextureType type;
+    TextureLayout layout = TEXTURE_LAYOUT_SCANLINE;
+    TextureCompression compression = TEXTURE_COMPRESSION_NONE;
+    float compressionPSNR = 0.f;    // Of level 0 against the texels it was compressed from, in dB
+    const TiledTexture* tiled = nullptr;    // Set for out-of-core textures, which have no texels in memory
+    bool flipRows = false;      // Rows are stored top down, as image files keep them; row 0 is the bottom one
 
     Vector2i resolution;
 
+    // Mip pyramid of 8-bit textures, each level half the size of the one before down to 1 x 1.
+    // Level 0 is 'data' itself.
+    int numLevels = 1;
+    void* levels[MAX_MIP_LEVELS] = {nullptr};
+    Vector2i levelResolution[MAX_MIP_LEVELS];
+    int levelPitch[MAX_MIP_LEVELS];     // Texels, tiles or blocks per row, or interleaved bits per axis for Morton
+
+    bool isLoaded() const { return this->data != nullptr || this->tiled != nullptr; }
+
+    // Position of texel 'x, y' of 'level' in its buffer; not for compressed textures
+    size_t texelIndex(int x, int y, int level) const;
+    // RGBA8 texel 'x, y' of 'level', wherever and however it is stored
+    uint32_t texel(int x, int y, int level) const;
+    // Texels stored for 'level', padding included
+    size_t levelTexels(int level) const;
+    // Bytes of texel memory over all levels
+    size_t memoryUsed() const;
+
     Texture() {};
-    Texture(std::string pathToImage);
+    Texture(std::string pathToImage, Arena& arena);
 
-    void allocate(TextureType type, Vector2i resolution);
+    void allocate(TextureType type, Vector2i resolution, Arena& arena);
     void writePixelColor(Vector3f color, int x, int y);
     Vector3f loadPixelColor(int x, int y);
+    Vector3f loadPixelColor(int x, int y, int level);
+
+    // Box-filters the levels below the loaded image; only for UNSIGNED_INTEGER_ALPHA textures
+    void generateMipmaps(Arena& arena);
+
+    // Copies every level into 'arena' in the given layout
+    void relayout(TextureLayout layout, Arena& arena);
+    // Encodes every level into 'arena' in the given block format and measures the loss
+    void compress(TextureCompression compression, Arena& arena);
     
-    void loadJpg(std::string pathToJpg);
-    void loadPng(std::string pathToPng);
-    void loadExr(std::string pathToExr);
+    void loadJpg(std::string pathToJpg, Arena& arena);
+    void loadPng(std::string pathToPng, Arena& arena);
+    void loadExr(std::string pathToExr, Arena& arena);
         
     void save(std::string path);
     void saveExr(std::string path);
     void savePng(std::string path);
 
     Vector3f nearestNeighbourFetch(float u, float v, int x, int y);     // x, y added for debugging
-    Vector2f getUVCoordinates(Vector3f intersection_point, Vector3f v1, Vector3f v2, Vector3f v3, Vector2f u1, Vector2f u2, Vector2f u3);
+    Vector2f getUVCoordinates(float b1, float b2, Vector2f u1, Vector2f u2, Vector2f u3);
     Vector3f bilinearFetch(float u, float v, int x, int y);             // x, y added for debugging
+
+    // The same lookups as above for a whole batch, with the filter math in SIMD; the results match
+    // the single fetches to the bit without FMA. Neither allocates.
+    void nearestNeighbourFetch(TextureBatch& batch);
+    void bilinearFetch(TextureBatch& batch);
+
+    // Bilinear fetches from the two mip levels around the one whose texels match the pixel footprint
+    // given by the uv derivatives, blended by the fractional level of detail
+    Vector3f trilinearFetch(float u, float v, Vector2f dUVdx, Vector2f dUVdy);
+    Vector3f bilinearLevelFetch(float u, float v, int level);
     // Vector3f getColor(int option);
-};
\ No newline at end of file
+};
+
+/*
+Every image a scene uses, decoded once per path. Surfaces request their images as soon as their materials
+are parsed; the decodes run on background threads while the rest of the scene loads, and get() hands out
+Textures that share the texels of that one decode. Surfaces naming the same image (typically the shapes
+of one OBJ sharing a material atlas) cost one decode and one copy in memory.
+request(), wait() and get() are called from the loading thread only.
+*/
+class TextureRegistry {
+public:
+    TextureRegistry() {}
+    ~TextureRegistry() { this->wait(); }
+
+    TextureRegistry(const TextureRegistry&) = delete;
+    TextureRegistry& operator=(const TextureRegistry&) = delete;
+
+    // Starts decoding 'path' into 'arena' unless an earlier request did; counts one more reference to it
+    void request(const std::string& path, Arena& arena);
+
+    // Decodes what no worker has started yet on this thread, then blocks until every requested image is decoded
+    void wait();
+
+    // The decoded texture at 'path', which must have been requested; call after wait()
+    Texture get(const std::string& path) const;
+
+    size_t size() const { return entries.size(); }
+
+    // Threads decoding at once, the loading thread's share in wait() included (--threads); 0 for every core
+    int numThreads = 0;
+
+    // When set, 8-bit images are read out of core through this cache instead of being decoded whole
+    TextureTileCache* tileCache = nullptr;
+
+    // One line per texture with its size and the number of surfaces sharing it
+    void report() const;
+
+private:
+    struct Entry {
+        std::string path;
+        Texture texture;
+        int references;
+        Arena* arena;
+    };
+
+    // Body of a worker thread
+    void decodeLoop();
+    // Decodes pending entries until there are none left
+    void decodePending();
+
+    std::deque<Entry> entries;      // Workers fill in entries while later ones are added, so they must not move
+    std::unordered_map<std::string, size_t> index;
+
+    std::mutex lock;
+    size_t nextPending = 0;
+    int activeWorkers = 0;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "texture.h"
+
+#include <atomic>
+#include <deque>
+
+/*
+Out-of-core textures (--texture-budget). Every 8-bit image is converted once into a pre-tiled file in the
+cache directory: all its mip levels cut into square tiles that are stored one after the other, so any
+tile is one read at a known offset. Fetches then go through a cache of tiles shared by all textures,
+which reads missing tiles from those files on demand and evicts the least recently used ones to stay
+within a fixed byte budget. A budget far below the size of the textures only costs more reads.
+*/
+
+#define TEXTURE_TILE_SIZE 64
+#define TEXTURE_TILE_VERSION 2
+
+// The cache is split into independently locked shards so render threads rarely wait on each other.
+// Every shard holds at least one tile, so the cache keeps 16 tiles (1 MB) however small the budget.
+#define TEXTURE_TILE_SHARDS 16
+
+// Tiles each thread reads again without going through a shard: a bilinear footprint, the two levels of
+// a trilinear fetch and the neighbouring pixels mostly stay within these
+#define TEXTURE_TILE_THREAD_TILES 4
+
+class TextureTileCache;
+
+// One opened tile file; Textures point to it instead of holding texels
+struct TiledTexture {
+    TextureTileCache* cache;
+    uint32_t fileIdx;
+    uint64_t levelFirstTile[MAX_MIP_LEVELS];    // Tiles are numbered level by level, row by row
+    int levelTilesX[MAX_MIP_LEVELS];
+    uint64_t tilesOffset;
+#ifdef _WIN32
+    void* fileHandle = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+class TextureTileCache {
+public:
+    // Holds at most 'budget' bytes of tiles, with the tile files kept in 'directory'
+    TextureTileCache(size_t budget, std::string directory);
+    ~TextureTileCache();
+
+    TextureTileCache(const TextureTileCache&) = delete;
+    TextureTileCache& operator=(const TextureTileCache&) = delete;
+
+    // Points 'texture' at the tile file of the image at 'path', writing the file from a full decode
+    // first if there is none. False if the image is not 8-bit or the file cannot be written or read.
+    // Thread-safe.
+    bool open(const std::string& path, Texture& texture);
+
+    // Texel 'x, y' of 'level', reading its tile if it is not resident. Thread-safe; texels of the tiles
+    // the calling thread used last are read without locking.
+    uint32_t texel(const TiledTexture& tiled, int x, int y, int level);
+
+    size_t hits() const;
+    size_t misses() const;
+    size_t evictions() const;
+    size_t bytesResident() const;
+
+    // Hit rate, evictions and resident memory against the budget
+    void report() const;
+
+private:
+    // A slot of a shard. 'sequence' is odd while the texels are being replaced, and changes with every
+    // replacement, so threads reading a tile without the shard lock can tell that it was evicted.
+    struct ResidentTile {
+        uint64_t key;
+        std::atomic<uint64_t> sequence{0};
+        uint32_t texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<uint64_t, int> slots;    // Resident tiles by key
+        std::vector<ResidentTile*> tiles;
+        std::vector<int> prev, next;                // Recency list through the slots
+        int head = -1, tail = -1;                   // Most and least recently used
+        size_t hits = 0, misses = 0, evictions = 0;
+    };
+
+    bool openFile(const std::string& filePath, uint64_t key, Texture& texture);
+    bool writeFile(const std::string& imagePath, const std::string& filePath, uint64_t key);
+    void readTile(const TiledTexture& tiled, uint64_t tile, uint32_t* texels);
+
+    // Hits on the tiles a thread keeps for itself, counted by that thread alone. Owned by the cache, as
+    // worker threads exit before the counts are read.
+    struct ThreadHits {
+        std::atomic<size_t> count{0};
+        char pad[64 - sizeof(std::atomic<size_t>)];    // Keeps threads off each other's cache lines
+    };
+
+    uint64_t id;        // Tells the threads' tiles of this cache from those of an earlier one at the same address
+    mutable std::mutex threadHitsLock;
+    std::deque<ThreadHits> threadHits;
+    size_t budget;
+    int slotsPerShard;
+    std::string directory;
+    Shard shards[TEXTURE_TILE_SHARDS];
+
+    std::mutex filesLock;
+    std::deque<TiledTexture> files;     // Never moved, Textures point into it
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "common.h"
+
+// Affine transform, stored as the top three rows of a 4x4 matrix acting on column vectors
+struct Transform {
+    float m[3][4] = {
+        {1.f, 0.f, 0.f, 0.f},
+        {0.f, 1.f, 0.f, 0.f},
+        {0.f, 0.f, 1.f, 0.f}
+    };
+
+    static Transform translate(Vector3f t)
+    {
+        Transform r;
+        r.m[0][3] = t.x, r.m[1][3] = t.y, r.m[2][3] = t.z;
+        return r;
+    }
+
+    static Transform scale(Vector3f s)
+    {
+        Transform r;
+        r.m[0][0] = s.x, r.m[1][1] = s.y, r.m[2][2] = s.z;
+        return r;
+    }
+
+    // Rotation by 'degrees' counter-clockwise around 'axis'
+    static Transform rotate(float degrees, Vector3f axis)
+    {
+        Vector3f a = Normalize(axis);
+        float theta = degrees * M_PI / 180.f;
+        float s = std::sin(theta), c = std::cos(theta);
+
+        Transform r;
+        r.m[0][0] = a.x * a.x + (1.f - a.x * a.x) * c;
+        r.m[0][1] = a.x * a.y * (1.f - c) - a.z * s;
+        r.m[0][2] = a.x * a.z * (1.f - c) + a.y * s;
+        r.m[1][0] = a.x * a.y * (1.f - c) + a.z * s;
+        r.m[1][1] = a.y * a.y + (1.f - a.y * a.y) * c;
+        r.m[1][2] = a.y * a.z * (1.f - c) - a.x * s;
+        r.m[2][0] = a.x * a.z * (1.f - c) - a.y * s;
+        r.m[2][1] = a.y * a.z * (1.f - c) + a.x * s;
+        r.m[2][2] = a.z * a.z + (1.f - a.z * a.z) * c;
+        return r;
+    }
+
+    // Applies 'other' first, then this
+    Transform operator*(const Transform& other) const
+    {
+        Transform r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                r.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j];
+                if (j == 3) r.m[i][j] += m[i][3];
+            }
+        }
+        return r;
+    }
+
+    float determinant() const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Only valid if determinant() != 0
+    Transform inverse() const
+    {
+        float invDet = 1.f / this->determinant();
+
+        Transform r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+        // The inverse translation is the inverted linear part applied to the negated translation
+        for (int i = 0; i < 3; i++)
+            r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+        return r;
+    }
+
+    bool isIdentity() const
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                if (m[i][j] != (i == j ? 1.f : 0.f)) return false;
+        return true;
+    }
+
+    Vector3f point(Vector3f p) const
+    {
+        return Vector3f(
+            m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]
+        );
+    }
+
+    Vector3f vector(Vector3f v) const
+    {
+        return Vector3f(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+        );
+    }
+
+    // Multiplies by the transpose of the linear part. Normals move by the inverse transpose, so
+    // calling this on the world-to-object transform takes an object-space normal to world space.
+    Vector3f normal(Vector3f n) const
+    {
+        return Vector3f(
+            m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+            m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+            m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z
+        );
+    }
+
+    // Box around the eight transformed corners of 'box'
+    AABB bounds(const AABB& box) const
+    {
+        AABB r;
+        for (int c = 0; c < 8; c++) {
+            Vector3f corner((c & 1) ? box.max.x : box.min.x, (c & 2) ? box.max.y : box.min.y, (c & 4) ? box.max.z : box.min.z);
+            r.grow(this->point(corner));
+        }
+        return r;
+    }
+};
@@ -5,14 +5,14 @@ Light::Light(LightType lightType, Vector3f locationOrDirection, Vector3f radianc
     locationOrDirection(locationOrDirection),
     radiance(radiance){}
 
-std::vector<Light> loadLights(nlohmann::json sceneConfig){
+std::vector<Light> loadLights(nlohmann::json& sceneConfig){
     std::vector<Light> lightVector;
     int light_index = 0;
 
     // std::cout << "Here " << __LINE__ << std::endl;
 
 	// Directional Lights
-    auto directionalLights = sceneConfig["directionalLights"];
+    auto& directionalLights = sceneConfig["directionalLights"];
     // std::cout << "Here " << __LINE__ << std::endl;
 
     for(auto& directionalLight : directionalLights){
@@ -44,7 +44,7 @@ std::vector<Light> loadLights(nlohmann::json sceneConfig){
 
     // std::cout << "Here " << __LINE__ << std::endl;
     // Point Lights
-    auto pointLights = sceneConfig["pointLights"];
+    auto& pointLights = sceneConfig["pointLights"];
 
     for(auto& pointLight : pointLights){
         auto& location = pointLight["location"];
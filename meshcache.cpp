@@ -0,0 +1,346 @@
+#include "meshcache.h"
+
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numSurfaces;
+    uint64_t key;
+    uint64_t fileSize;
+};
+
+// One surface; offsets are from the start of the file
+struct MeshCacheRecord {
+    uint64_t verticesOffset, normalsOffset, uvsOffset;
+    uint64_t trisOffset, nodesOffset, wideNodesOffset, triBlocksOffset;
+    uint32_t numVertices, numTris, numBVHNodes, numWideNodes, numTriBlocks;
+    uint32_t padding;
+    uint64_t diffuseTextureOffset, alphaTextureOffset;
+    uint32_t diffuseTextureLength, alphaTextureLength;
+    AABB bbox;
+    Vector3f diffuse;
+    float alpha;
+};
+
+// Every byte is a member, so value-initialized records are written out fully zeroed and files are byte-stable
+static_assert(sizeof(MeshCacheRecord) == 7 * 8 + 6 * 4 + 2 * 8 + 2 * 4 + sizeof(AABB) + sizeof(Vector3f) + sizeof(float),
+    "MeshCacheRecord has implicit padding");
+
+static const char meshCacheMagic[8] = {'B', 'V', 'H', 'C', 'A', 'C', 'H', 'E'};
+
+// Four independent lanes so the multiplies overlap
+uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t seed)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h[4] = {seed ^ size, seed + k, seed ^ (k >> 7), seed - k};
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, data + i + 8 * l, 8);
+            h[l] = (h[l] ^ w) * k;
+            h[l] ^= h[l] >> 32;
+        }
+    }
+    for (; i < size; i++)
+        h[0] = (h[0] ^ data[i]) * k;
+
+    uint64_t r = h[0];
+    for (int l = 1; l < 4; l++) {
+        r = (r ^ h[l]) * k;
+        r ^= r >> 29;
+    }
+    return r;
+}
+
+// Names given on the "mtllib" lines of an OBJ file
+static std::vector<std::string> findMaterialLibraries(const uint8_t* data, size_t size)
+{
+    std::vector<std::string> names;
+    const char* begin = (const char*)data;
+    const char* end = begin + size;
+
+    for (const char* p = begin; (p = (const char*)memchr(p, 'm', end - p)) != nullptr; p++) {
+        if ((p != begin && p[-1] != '\n') || end - p < 7 || memcmp(p, "mtllib", 6) != 0 || (p[6] != ' ' && p[6] != '\t'))
+            continue;
+
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        std::istringstream line(std::string(p + 7, lineEnd ? lineEnd : end));
+        std::string name;
+        while (line >> name)
+            names.push_back(name);
+    }
+
+    return names;
+}
+
+uint64_t meshCacheKey(const std::string& pathToObj)
+{
+    MappedFile obj;
+    if (!obj.open(pathToObj)) return 0;
+
+    uint64_t key = hashBytes(obj.data, obj.size, MESH_CACHE_VERSION);
+
+    std::string objDirectory;
+    const size_t last_slash_idx = pathToObj.rfind('/');
+    if (std::string::npos != last_slash_idx) {
+        objDirectory = pathToObj.substr(0, last_slash_idx + 1);
+    }
+
+    // Materials are stored with the surfaces, so the material files are part of the content. Textures
+    // are only referenced by path and loaded again on every run; those paths start with the OBJ's
+    // directory, so the same mesh in another directory gets its own entry.
+    key = hashBytes((const uint8_t*)objDirectory.data(), objDirectory.size(), key);
+    for (auto& name : findMaterialLibraries(obj.data, obj.size)) {
+        key = hashBytes((const uint8_t*)name.data(), name.size(), key);
+
+        MappedFile mtl;
+        if (mtl.open(objDirectory + name)) {
+            key = hashBytes(mtl.data, mtl.size, key);
+            mtl.close();
+        }
+    }
+    obj.close();
+
+    // Everything that changes the trees or their layout in memory
+    uint32_t traversalCost, intersectionCost;
+    memcpy(&traversalCost, &bvhSettings.traversalCost, 4);
+    memcpy(&intersectionCost, &bvhSettings.intersectionCost, 4);
+    uint64_t settings[] = {
+        uint64_t(bvhSettings.builder), bvhSettings.maxLeafSize, traversalCost, intersectionCost,
+        BVH_WIDTH, TRI_BLOCK_SIZE, SAH_BINS, sizeof(Vector3f), sizeof(Vector2f), sizeof(Tri), sizeof(BVHNode), sizeof(TriBlock),
+#if BVH_WIDTH > 2
+        sizeof(WideBVHNode<BVH_WIDTH>),
+#endif
+    };
+    key = hashBytes((const uint8_t*)settings, sizeof(settings), key);
+
+    // 0 means the file could not be read
+    return key ? key : 1;
+}
+
+std::string meshCachePath(uint64_t key)
+{
+    std::ostringstream path;
+    path << bvhSettings.cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+    return path.str();
+}
+
+// True if 'count' elements of 'elementSize' at 'offset' lie inside the file, suitably aligned
+static bool validSection(const MappedFile& file, uint64_t offset, uint64_t count, size_t elementSize)
+{
+    return offset % CACHE_LINE_SIZE == 0 && offset <= file.size && count <= (file.size - offset) / elementSize;
+}
+
+bool loadMeshCache(uint64_t key, bool isLight, uint32_t shapeIdx, std::vector<Surface>& surfaces, Arena& arena, TextureRegistry& textures)
+{
+    MappedFile file;
+    if (!file.open(meshCachePath(key))) return false;
+
+    MeshCacheHeader header;
+    bool valid = file.size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, file.data, sizeof(header));
+        valid = memcmp(header.magic, meshCacheMagic, 8) == 0 && header.version == MESH_CACHE_VERSION
+            && header.key == key && header.fileSize == file.size
+            && header.numSurfaces <= (file.size - sizeof(header)) / sizeof(MeshCacheRecord);
+    }
+
+    for (uint32_t s = 0; valid && s < header.numSurfaces; s++) {
+        MeshCacheRecord record;
+        memcpy(&record, file.data + sizeof(header) + s * sizeof(record), sizeof(record));
+
+        valid = validSection(file, record.verticesOffset, record.numVertices, sizeof(Vector3f))
+            && validSection(file, record.normalsOffset, record.numVertices, sizeof(Vector3f))
+            && validSection(file, record.uvsOffset, record.numVertices, sizeof(Vector2f))
+            && validSection(file, record.trisOffset, record.numTris, sizeof(Tri))
+            && validSection(file, record.nodesOffset, record.numBVHNodes, sizeof(BVHNode))
+            && validSection(file, record.triBlocksOffset, record.numTriBlocks, sizeof(TriBlock))
+#if BVH_WIDTH > 2
+            && validSection(file, record.wideNodesOffset, record.numWideNodes, sizeof(WideBVHNode<BVH_WIDTH>))
+#endif
+            && record.diffuseTextureOffset <= file.size && record.diffuseTextureLength <= file.size - record.diffuseTextureOffset
+            && record.alphaTextureOffset <= file.size && record.alphaTextureLength <= file.size - record.alphaTextureOffset;
+        if (!valid) break;
+
+        Surface surf;
+        surf.isLight = isLight;
+        surf.shapeIdx = shapeIdx + s;    // Records follow the shapes, each of which createSurfaces numbers in turn
+        surf.vertices = (Vector3f*)(file.data + record.verticesOffset);
+        surf.normals = (Vector3f*)(file.data + record.normalsOffset);
+        surf.uvs = (Vector2f*)(file.data + record.uvsOffset);
+        surf.numVertices = record.numVertices;
+        surf.tris = (Tri*)(file.data + record.trisOffset);
+        surf.numTris = record.numTris;
+        surf.nodes = (BVHNode*)(file.data + record.nodesOffset);
+        surf.numBVHNodes = record.numBVHNodes;
+        surf.triBlocks = (TriBlock*)(file.data + record.triBlocksOffset);
+        surf.numTriBlocks = record.numTriBlocks;
+#if BVH_WIDTH > 2
+        surf.wideNodes = (WideBVHNode<BVH_WIDTH>*)(file.data + record.wideNodesOffset);
+        surf.numWideNodes = record.numWideNodes;
+#endif
+        surf.bbox = record.bbox;
+        surf.diffuse = record.diffuse;
+        surf.alpha = record.alpha;
+
+        surf.diffuseTexturePath = std::string((const char*)file.data + record.diffuseTextureOffset, record.diffuseTextureLength);
+        surf.alphaTexturePath = std::string((const char*)file.data + record.alphaTextureOffset, record.alphaTextureLength);
+
+        surfaces.push_back(std::move(surf));
+    }
+
+    if (!valid) {
+        std::cerr << "Ignoring invalid mesh cache file " << meshCachePath(key) << std::endl;
+        surfaces.clear();
+        file.close();
+        return false;
+    }
+
+    // Only a valid entry requests its images, so a rejected one leaves no references behind
+    for (auto& surf : surfaces) {
+        if (surf.diffuseTexturePath != "")
+            textures.request(surf.diffuseTexturePath, arena);
+        if (surf.alphaTexturePath != "")
+            textures.request(surf.alphaTexturePath, arena);
+    }
+
+    // The surfaces point into the mapping, so it stays open as long as they do
+    arena.adopt(file);
+    return true;
+}
+
+static uint64_t alignOffset(uint64_t offset)
+{
+    return (offset + CACHE_LINE_SIZE - 1) & ~uint64_t(CACHE_LINE_SIZE - 1);
+}
+
+bool saveMeshCache(uint64_t key, const Surface* surfaces, uint32_t numSurfaces)
+{
+#ifdef _WIN32
+    _mkdir(bvhSettings.cacheDirectory.c_str());
+#else
+    mkdir(bvhSettings.cacheDirectory.c_str(), 0755);
+#endif
+
+    // Lay the file out first: header, records, texture paths, then the aligned sections. The records
+    // start out value-initialized, so fields and padding not set below are zero.
+    std::vector<MeshCacheRecord> records(numSurfaces);
+    uint64_t offset = sizeof(MeshCacheHeader) + numSurfaces * sizeof(MeshCacheRecord);
+    for (uint32_t s = 0; s < numSurfaces; s++) {
+        const Surface& surf = surfaces[s];
+        MeshCacheRecord& record = records[s];
+
+        record.diffuseTextureOffset = offset;
+        record.diffuseTextureLength = surf.diffuseTexturePath.size();
+        offset += record.diffuseTextureLength;
+        record.alphaTextureOffset = offset;
+        record.alphaTextureLength = surf.alphaTexturePath.size();
+        offset += record.alphaTextureLength;
+
+        record.bbox = surf.bbox;
+        record.diffuse = surf.diffuse;
+        record.alpha = surf.alpha;
+    }
+    for (uint32_t s = 0; s < numSurfaces; s++) {
+        const Surface& surf = surfaces[s];
+        MeshCacheRecord& record = records[s];
+
+        record.numVertices = surf.numVertices;
+        record.verticesOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numVertices) * sizeof(Vector3f);
+        record.normalsOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numVertices) * sizeof(Vector3f);
+        record.uvsOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numVertices) * sizeof(Vector2f);
+
+        record.numTris = surf.numTris;
+        record.trisOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numTris) * sizeof(Tri);
+
+        record.numBVHNodes = surf.numBVHNodes;
+        record.nodesOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numBVHNodes) * sizeof(BVHNode);
+
+        record.numTriBlocks = surf.numTriBlocks;
+        record.triBlocksOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numTriBlocks) * sizeof(TriBlock);
+
+#if BVH_WIDTH > 2
+        record.numWideNodes = surf.numWideNodes;
+        record.wideNodesOffset = offset = alignOffset(offset);
+        offset += uint64_t(surf.numWideNodes) * sizeof(WideBVHNode<BVH_WIDTH>);
+#endif
+    }
+
+    MeshCacheHeader header;
+    memcpy(header.magic, meshCacheMagic, 8);
+    header.version = MESH_CACHE_VERSION;
+    header.numSurfaces = numSurfaces;
+    header.key = key;
+    header.fileSize = offset;
+
+    // Written under a temporary name and renamed, so a concurrent run never maps half a file
+    std::string path = meshCachePath(key);
+    std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary);
+
+    const char zeros[CACHE_LINE_SIZE] = {0};
+    uint64_t written = 0;
+    auto write = [&](const void* data, uint64_t size) {
+        out.write((const char*)data, size);
+        written += size;
+    };
+    auto pad = [&](uint64_t to) {
+        out.write(zeros, to - written);
+        written = to;
+    };
+
+    write(&header, sizeof(header));
+    write(records.data(), numSurfaces * sizeof(MeshCacheRecord));
+    for (uint32_t s = 0; s < numSurfaces; s++) {
+        write(surfaces[s].diffuseTexturePath.data(), surfaces[s].diffuseTexturePath.size());
+        write(surfaces[s].alphaTexturePath.data(), surfaces[s].alphaTexturePath.size());
+    }
+    for (uint32_t s = 0; s < numSurfaces; s++) {
+        const Surface& surf = surfaces[s];
+        const MeshCacheRecord& record = records[s];
+
+        pad(record.verticesOffset);
+        write(surf.vertices, uint64_t(surf.numVertices) * sizeof(Vector3f));
+        pad(record.normalsOffset);
+        write(surf.normals, uint64_t(surf.numVertices) * sizeof(Vector3f));
+        pad(record.uvsOffset);
+        write(surf.uvs, uint64_t(surf.numVertices) * sizeof(Vector2f));
+        pad(record.trisOffset);
+        write(surf.tris, uint64_t(surf.numTris) * sizeof(Tri));
+        pad(record.nodesOffset);
+        write(surf.nodes, uint64_t(surf.numBVHNodes) * sizeof(BVHNode));
+        pad(record.triBlocksOffset);
+        write(surf.triBlocks, uint64_t(surf.numTriBlocks) * sizeof(TriBlock));
+#if BVH_WIDTH > 2
+        pad(record.wideNodesOffset);
+        write(surf.wideNodes, uint64_t(surf.numWideNodes) * sizeof(WideBVHNode<BVH_WIDTH>));
+#endif
+    }
+    out.close();
+
+    if (!out || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Could not write mesh cache file " << path << std::endl;
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,111 @@
+#include "parallel.h"
+
+bool WorkQueue::popFront(int& task)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->tasks.empty()) return false;
+
+    task = this->tasks.front();
+    this->tasks.pop_front();
+    return true;
+}
+
+bool WorkQueue::popBack(int& task)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->tasks.empty()) return false;
+
+    task = this->tasks.back();
+    this->tasks.pop_back();
+    return true;
+}
+
+int defaultThreadCount()
+{
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Threads currently reserved through reserveThreads, across all calls; the calling threads are not counted
+static std::atomic<int> extraThreads(0);
+
+int reserveThreads(int wanted, int numThreads)
+{
+    int running = extraThreads.load();
+    while (true) {
+        int granted = std::min(wanted, numThreads - 1 - running);
+        if (granted <= 0) return 0;
+        if (extraThreads.compare_exchange_weak(running, running + granted)) return granted;
+    }
+}
+
+void releaseThreads(int count)
+{
+    extraThreads -= count;
+}
+
+void parallelFor(int numTasks, int numThreads, const std::function<void(int)>& task)
+{
+    if (numThreads > 1 && numTasks > 1)
+        numThreads = 1 + reserveThreads(std::min(numThreads, numTasks) - 1, numThreads);
+    if (numThreads <= 1 || numTasks <= 1) {
+        for (int i = 0; i < numTasks; i++)
+            task(i);
+        return;
+    }
+
+    std::vector<WorkQueue> queues(numThreads);
+    int perThread = (numTasks + numThreads - 1) / numThreads;
+    for (int i = 0; i < numTasks; i++)
+        queues[i / perThread].tasks.push_back(i);
+
+    auto worker = [&](int id) {
+        int t;
+        while (true) {
+            if (queues[id].popFront(t)) {
+                task(t);
+                continue;
+            }
+
+            // Own queue is empty, try to steal from someone else
+            bool stole = false;
+            for (int k = 1; k < numThreads && !stole; k++) {
+                if (queues[(id + k) % numThreads].popBack(t)) {
+                    task(t);
+                    stole = true;
+                }
+            }
+
+            // Tasks never spawn other tasks, so empty queues everywhere means we're done
+            if (!stole) return;
+        }
+    };
+
+    // Started workers hand their thread back as soon as they run out of work, so that builds still
+    // running can fork into it
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++) {
+        threads.push_back(std::thread([&, i]() {
+            worker(i);
+            releaseThreads(1);
+        }));
+    }
+    worker(0);
+
+    for (auto& th : threads)
+        th.join();
+}
+
+void parallelInvoke(int numThreads, const std::function<void()>& a, const std::function<void()>& b)
+{
+    if (reserveThreads(1, numThreads) == 0) {
+        a();
+        b();
+        return;
+    }
+
+    std::thread forked(a);
+    b();
+    forked.join();
+    releaseThreads(1);
+}
@@ -1,96 +1,154 @@
 #include "render.h"
 #include "shade.h"
+#include "parallel.h"
 
-Integrator::Integrator(Scene &scene)
+#include <limits>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+Integrator::Integrator(Scene &scene, int numThreads, int packetSize)
+    : scene(scene)
 {
-    this->scene = scene;
-    this->outputImage.allocate(TextureType::UNSIGNED_INTEGER_ALPHA, this->scene.imageResolution);
+    this->numThreads = numThreads;
+    this->packetSize = packetSize;
+    this->outputImage.allocate(TextureType::UNSIGNED_INTEGER_ALPHA, this->scene.imageResolution, this->arena);
 }
 
-long long Integrator::render()
+Vector3f Integrator::shadePixel(const Interaction& si, int x, int y)
 {
     Vector3f white_color = {1, 1, 1};
-    auto startTime = std::chrono::high_resolution_clock::now();
-    int printed = 0;
-    for (int x = 0; x < this->scene.imageResolution.x; x++) {
-        for (int y = 0; y < this->scene.imageResolution.y; y++) {
-            Vector3f color = {0, 0, 0};
-            
-            Ray cameraRay = this->scene.camera.generateRay(x, y);
-            Interaction si = this->scene.rayIntersect(cameraRay);
+    Vector3f color = {0, 0, 0};
 
-            // Not doing this:    // Might be too dumb to do and even this might not work with some fairly complex scenes
-            // Not doing this:    // Iterate through all the triangles and see which triangle has its vertices closest to to the intersection point and on the plane and the normal = sum of normals of the vertices / 3 normalised
+    // Not doing this:    // Might be too dumb to do and even this might not work with some fairly complex scenes
+    // Not doing this:    // Iterate through all the triangles and see which triangle has its vertices closest to to the intersection point and on the plane and the normal = sum of normals of the vertices / 3 normalised
 
 
-            if(si.didIntersect){
+    if(si.didIntersect){
 
-                Vector2f uv = this->outputImage.getUVCoordinates(
-                    si.p, 
-                    si.triangleIntersected.v1, si.triangleIntersected.v2, si.triangleIntersected.v3, 
-                    si.triangleIntersected.uv1, si.triangleIntersected.uv2, si.triangleIntersected.uv3
-                );
-                if(si.intersected_on_surface->hasDiffuseTexture()){
-                    if(option == 0){
-                        if(!(printed++))
-                        std::cout << "Doing Nearest Neighbor Fetch" << std::endl;
-                        white_color = si.intersected_on_surface->diffuseTexture.nearestNeighbourFetch(uv.x, uv.y, x, y);
-                    }
-                    else if(option == 1){
-                        if(!(printed++))
-                        std::cout << "Doing Bilinear Interpolation" << std::endl;
-                        white_color = si.intersected_on_surface->diffuseTexture.bilinearFetch(uv.x, uv.y, x, y);
-                        if(x == 900 && y == 750){
-                            std::cout << "White color" << std::endl;
-
-                            std::cout << white_color.x << ", " << white_color.y << ", " << white_color.z << std::endl;
-                        }
-                    }
+        const Surface* surf = si.intersected_on_surface;
+        const Tri& tri = surf->tris[si.primIdx];
+        Vector2f uv = this->outputImage.getUVCoordinates(si.b1, si.b2, surf->uvs[tri.v[0]], surf->uvs[tri.v[1]], surf->uvs[tri.v[2]]);
+        if(si.intersected_on_surface->hasDiffuseTexture()){
+            if(option == 0){
+                white_color = si.intersected_on_surface->diffuseTexture.nearestNeighbourFetch(uv.x, uv.y, x, y);
+            }
+            else if(option == 1){
+                white_color = si.intersected_on_surface->diffuseTexture.bilinearFetch(uv.x, uv.y, x, y);
+                if(x == 900 && y == 750){
+                    std::cout << "White color" << std::endl;
+
+                    std::cout << white_color.x << ", " << white_color.y << ", " << white_color.z << std::endl;
                 }
-                else{
-                    white_color = si.intersected_on_surface->diffuse;
+            }
+            else if(option == 2){
+                white_color = si.intersected_on_surface->diffuseTexture.trilinearFetch(uv.x, uv.y, si.dUVdx, si.dUVdy);
+            }
+        }
+        else{
+            white_color = si.intersected_on_surface->diffuse;
+        }
+        // if(uv.x != 0 || uv.y != 0){
+
+        //     std::cout << uv.x << ", " << uv.y << std::endl;
+        //     std::cout << "x, y: " << x << ", " << y << std::endl;
+        // }
+        if(x == 900 && y == 750){
+            std::cout << "Has diffuse structure: " << si.intersected_on_surface->hasDiffuseTexture() << std::endl;
+            std::cout << uv.x << ", " << uv.y << std::endl;
+            std::cout << white_color.x << ", " << white_color.y << ", " << white_color.z << std::endl;
+        }
+
+        for(auto& light : this->scene.lights){
+            if(light.lightType == DIRECTIONAL_LIGHT){
+                // Now we will see if the ray intersected in the direction of the light from the point where it intersected with the scene from the viewport
+                Ray shadowRay = Ray(si.p + 0.001 * si.n, light.locationOrDirection);
+
+                if(!this->scene.occluded(shadowRay)){
+                    color += shade(light, white_color) * AbsDot(light.locationOrDirection, si.n);
                 }
-                // if(uv.x != 0 || uv.y != 0){
+            }
+            else if(light.lightType == POINT_LIGHT){
+                Vector3f displacementVector = light.locationOrDirection - si.p;
+                Vector3f direction = Normalize(displacementVector);
 
-                //     std::cout << uv.x << ", " << uv.y << std::endl;
-                //     std::cout << "x, y: " << x << ", " << y << std::endl;
-                // }
-                if(x == 900 && y == 750){
-                    std::cout << "Has diffuse structure: " << si.intersected_on_surface->hasDiffuseTexture() << std::endl;
-                    std::cout << uv.x << ", " << uv.y << std::endl;
-                    std::cout << white_color.x << ", " << white_color.y << ", " << white_color.z << std::endl;
+                // Only blockers between the point and the light matter
+                Ray shadowRay = Ray(si.p + 0.001 * si.n, direction);
+                
+                if(!this->scene.occluded(shadowRay, displacementVector.Length())){
+                    color += shade(light, white_color) * AbsDot(direction, si.n) / Dot(displacementVector, displacementVector);
                 }
+            }
+        }
+        // this->outputImage.writePixelColor(color, x, y);
+    }
+    return color;
+}
 
-                for(auto& light : this->scene.lights){
-                    if(light.lightType == DIRECTIONAL_LIGHT){
-                        // Now we will see if the ray intersected in the direction of the light from the point where it intersected with the scene from the viewport
-                        Ray shadowRay = Ray(si.p + 0.001 * si.n, light.locationOrDirection);
-                        Interaction shadowRayInteraction = this->scene.rayIntersect(shadowRay);
+void Integrator::renderTile(Tile tile)
+{
+    if (this->packetSize > 0) {
+        RayPacket packet;
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += this->packetSize) {
+            for (int x0 = tile.x0; x0 < tile.x1; x0 += this->packetSize) {
+                int x1 = std::min(x0 + this->packetSize, tile.x1), y1 = std::min(y0 + this->packetSize, tile.y1);
+                this->scene.camera.generatePacket(x0, y0, x1, y1, packet);
+                this->scene.intersectPacket(packet);
 
-                        if(!shadowRayInteraction.didIntersect){
-                            color += shade(light, white_color) * AbsDot(light.locationOrDirection, si.n);
-                        }
-                    }
-                    else if(light.lightType == POINT_LIGHT){
-                        Vector3f displacementVector = light.locationOrDirection - si.p;
-                        Vector3f direction = Normalize(displacementVector);
-
-                        Ray shadowRay = Ray(si.p + 0.001 * si.n, direction);
-                        Interaction shadowRayInteraction = this->scene.rayIntersect(shadowRay);
-                        
-                        if(!shadowRayInteraction.didIntersect){
-                            color += shade(light, white_color) * AbsDot(direction, si.n) / Dot(displacementVector, displacementVector);
-                        }
-                        if(shadowRayInteraction.didIntersect && Dot(shadowRayInteraction.p - si.p, shadowRayInteraction.p - si.p) > Dot(displacementVector, displacementVector)){
-                            color += shade(light, white_color) * AbsDot(direction, si.n) / Dot(displacementVector, displacementVector);
-                        }
+                for (int y = y0, i = 0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++, i++) {
+                        Interaction si = this->scene.computeInteraction(packet.rays[i], packet.hits[i]);
+                        this->outputImage.writePixelColor(this->shadePixel(si, x, y), x, y);
                     }
                 }
-                // this->outputImage.writePixelColor(color, x, y);
             }
-            this->outputImage.writePixelColor(color, x, y);
+        }
+        return;
+    }
+
+    for (int x = tile.x0; x < tile.x1; x++) {
+        for (int y = tile.y0; y < tile.y1; y++) {
+            Ray cameraRay = this->scene.camera.generateRay(x, y);
+            Interaction si = this->scene.rayIntersect(cameraRay);
+
+            this->outputImage.writePixelColor(this->shadePixel(si, x, y), x, y);
+        }
+    }
+}
+
+long long Integrator::render()
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    if(option == 0)
+        std::cout << "Doing Nearest Neighbor Fetch" << std::endl;
+    else if(option == 1)
+        std::cout << "Doing Bilinear Interpolation" << std::endl;
+    else if(option == 2)
+        std::cout << "Doing Trilinear Interpolation" << std::endl;
+
+    // Split the image into tiles; every pixel is written by exactly one tile, so the output does not depend on the thread count
+    std::vector<Tile> tiles;
+    for (int y = 0; y < this->scene.imageResolution.y; y += TILE_SIZE) {
+        for (int x = 0; x < this->scene.imageResolution.x; x += TILE_SIZE) {
+            Tile tile;
+            tile.x0 = x;
+            tile.y0 = y;
+            tile.x1 = std::min(x + TILE_SIZE, this->scene.imageResolution.x);
+            tile.y1 = std::min(y + TILE_SIZE, this->scene.imageResolution.y);
+            tiles.push_back(tile);
         }
     }
+
+    parallelFor(tiles.size(), this->numThreads, [&](int i) {
+        this->renderTile(tiles[i]);
+    });
+
     auto finishTime = std::chrono::high_resolution_clock::now();
 
     return std::chrono::duration_cast<std::chrono::microseconds>(finishTime - startTime).count();
@@ -98,30 +156,157 @@ long long Integrator::render()
 
 int option = 0;
 
+// Largest resident set of the process so far, in bytes
+static size_t peakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Peak signal-to-noise ratio of the 8-bit colors of 'image' against 'reference', in dB
+static float imagePSNR(const Texture& image, const Texture& reference)
+{
+    double squaredError = 0.0;
+    for (int y = 0; y < image.resolution.y; y++) {
+        for (int x = 0; x < image.resolution.x; x++) {
+            uint32_t a = image.texel(x, y, 0), b = reference.texel(x, y, 0);
+            for (int shift = 0; shift < 24; shift += 8) {
+                int d = int((a >> shift) & 255u) - int((b >> shift) & 255u);
+                squaredError += d * d;
+            }
+        }
+    }
+
+    double meanSquaredError = squaredError / (3.0 * image.resolution.x * image.resolution.y);
+    return meanSquaredError > 0.0 ? float(10.0 * std::log10(255.0 * 255.0 / meanSquaredError)) : std::numeric_limits<float>::infinity();
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 4) {
-        std::cerr << "Usage: ./render <scene_config> <out_path> <interpolation_variant>";
+    int numThreads = defaultThreadCount();
+    int packetSize = 0;
+    bool compareBVH = false;
+    bool compareUncompressed = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            numThreads = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--bvh" && i + 1 < argc) {
+            if (!parseBVHBuilder(argv[++i], bvhSettings.builder)) {
+                std::cerr << "Unknown BVH builder: " << argv[i] << " (expected midpoint, sah or lbvh)" << std::endl;
+                return 1;
+            }
+            bvhSettings.builderFromCommandLine = true;
+        }
+        else if (arg == "--leaf-size" && i + 1 < argc) {
+            bvhSettings.maxLeafSize = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--texture-layout" && i + 1 < argc) {
+            if (!parseTextureLayout(argv[++i], Texture::loadLayout)) {
+                std::cerr << "Unknown texture layout: " << argv[i] << " (expected scanline, tiled4, tiled8 or morton)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--huge-pages") {
+            Arena::useHugePages = true;
+        }
+        else if (arg == "--cache" && i + 1 < argc) {
+            bvhSettings.cacheDirectory = argv[++i];
+        }
+        else if (arg == "--texture-compression" && i + 1 < argc) {
+            if (!parseTextureCompression(argv[++i], Texture::loadCompression)) {
+                std::cerr << "Unknown texture compression: " << argv[i] << " (expected none or bc1)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--compare-uncompressed") {
+            compareUncompressed = true;
+        }
+        else if (arg == "--texture-budget" && i + 1 < argc) {
+            Texture::tileBudget = size_t(std::max(1, std::stoi(argv[++i]))) * 1024 * 1024;
+        }
+        else if (arg == "--compare-bvh") {
+            compareBVH = true;
+        }
+        else if (arg == "--packets" && i + 1 < argc) {
+            packetSize = std::stoi(argv[++i]);
+            if (packetSize < 0 || packetSize > MAX_PACKET_SIZE) {
+                std::cerr << "Packet size must be between 0 and " << MAX_PACKET_SIZE << std::endl;
+                return 1;
+            }
+        }
+        else {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() != 3) {
+        std::cerr << "Usage: ./render <scene_config> <out_path> <interpolation_variant> [--threads N] [--bvh midpoint|sah|lbvh] [--compare-bvh] [--leaf-size N] [--packets N] [--cache DIR] [--huge-pages] [--texture-layout scanline|tiled4|tiled8|morton] [--texture-compression none|bc1] [--compare-uncompressed] [--texture-budget MB]";
         return 1;
     }
-    if(std::stoi(argv[3]) == 0){
+    if (Texture::tileBudget > 0 && bvhSettings.cacheDirectory.empty()) {
+        std::cerr << "--texture-budget keeps its tile files in the mesh cache directory and needs --cache DIR" << std::endl;
+        return 1;
+    }
+    if (Texture::tileBudget > 0 && Texture::loadCompression != TEXTURE_COMPRESSION_NONE) {
+        std::cerr << "--texture-compression applies to textures in memory and cannot be combined with --texture-budget" << std::endl;
+        return 1;
+    }
+    if (compareUncompressed && Texture::loadCompression == TEXTURE_COMPRESSION_NONE) {
+        std::cerr << "--compare-uncompressed needs --texture-compression" << std::endl;
+        return 1;
+    }
+    if(std::stoi(args[2]) == 0){
         option = 0;
     }
-    else if(std::stoi(argv[3]) == 1){
+    else if(std::stoi(args[2]) == 1){
         option = 1;
     }
+    else if(std::stoi(args[2]) == 2){
+        option = 2;
+    }
     else{
         std::cerr << "No such option exists" << std::endl;
         return 1;
     }
 
-    Scene scene(argv[1]);
+    bvhSettings.buildThreads = numThreads;
+    Scene scene(args[0]);
+    if (compareBVH) scene.compareBuilders();
 
-    Integrator rayTracer(scene);
+    Integrator rayTracer(scene, numThreads, packetSize);
     auto renderTime = rayTracer.render();
     
-    std::cout << "Render Time: " << std::to_string(renderTime / 1000.f) << " ms" << std::endl;
-    rayTracer.outputImage.save(argv[2]);
+    std::cout << "Render Time: " << std::to_string(renderTime / 1000.f) << " ms (" << numThreads << " threads"
+        << (packetSize > 0 ? ", " + std::to_string(packetSize) + "x" + std::to_string(packetSize) + " packets" : "") << ")" << std::endl;
+    rayTracer.outputImage.save(args[1]);
+    if (scene.tileCache) scene.tileCache->report();
+
+    if (compareUncompressed) {
+        // The same render from uncompressed textures is the reference for what the compression loses
+        std::cout << "Rendering the uncompressed reference:" << std::endl;
+        Texture::loadCompression = TEXTURE_COMPRESSION_NONE;
+        Scene reference(args[0]);
+        Integrator referenceTracer(reference, numThreads, packetSize);
+        referenceTracer.render();
+        std::cout << "Texture compression: image PSNR " << imagePSNR(rayTracer.outputImage, referenceTracer.outputImage)
+            << " dB against uncompressed textures" << std::endl;
+    }
+
+    std::cout << "Peak memory: " << peakMemoryUsage() / (1024.f * 1024.f) << " MB" << std::endl;
 
     return 0;
 }
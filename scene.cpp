@@ -1,5 +1,9 @@
 #include "scene.h"
 #include "light.h"
+#include "parallel.h"
+#include "meshcache.h"
+
+#include <iomanip>
 
 Scene::Scene(std::string sceneDirectory, std::string sceneJson)
 {
@@ -42,11 +46,19 @@ Scene::Scene(std::string pathToJson)
     this->parse(sceneDirectory, sceneConfig);
 }
 
-void Scene::parse(std::string sceneDirectory, nlohmann::json sceneConfig)
+void Scene::parse(std::string sceneDirectory, nlohmann::json& sceneConfig)
 {
+    this->textures->numThreads = bvhSettings.buildThreads;
+
+    // Tile files live next to the mesh cache entries
+    if (Texture::tileBudget > 0 && !bvhSettings.cacheDirectory.empty()) {
+        this->tileCache = std::make_unique<TextureTileCache>(Texture::tileBudget, bvhSettings.cacheDirectory);
+        this->textures->tileCache = this->tileCache.get();
+    }
+
     // Output
     try {
-        auto res = sceneConfig["output"]["resolution"];
+        auto& res = sceneConfig["output"]["resolution"];
         this->imageResolution = Vector2i(res[0], res[1]);
     }
     catch (nlohmann::json::exception e) {
@@ -56,7 +68,7 @@ void Scene::parse(std::string sceneDirectory, nlohmann::json sceneConfig)
 
     // Cameras
     try {
-        auto cam = sceneConfig["camera"];
+        auto& cam = sceneConfig["camera"];
 
         this->camera = Camera(
             Vector3f(cam["from"][0], cam["from"][1], cam["from"][2]),
@@ -77,48 +89,229 @@ void Scene::parse(std::string sceneDirectory, nlohmann::json sceneConfig)
     this->lights = loadLights(sceneConfig);
     std::cout << "Here::> " << __LINE__ << std::endl;
 
+    // BVH builder, unless one was given on the command line. Read before the surfaces, whose cache entries depend on it
+    if (sceneConfig.contains("bvh") && !bvhSettings.builderFromCommandLine) {
+        auto& builder = sceneConfig["bvh"];
+        if (!builder.is_string() || !parseBVHBuilder(builder.get<std::string>(), bvhSettings.builder)) {
+            std::cerr << "Unknown BVH builder in the scene file: " << builder.dump() << std::endl;
+            exit(1);
+        }
+    }
+
     // Surface
     try {
-        auto surfacePaths = sceneConfig["surface"];
+        auto& surfacePaths = sceneConfig["surface"];
 
-        uint32_t surfaceIdx = 0;
-        for (std::string surfacePath : surfacePaths) {
-            surfacePath = sceneDirectory + "/" + surfacePath;
-
-            auto surf = createSurfaces(surfacePath, /*isLight=*/false, /*idx=*/surfaceIdx);
-            this->surfaces.insert(this->surfaces.end(), surf.begin(), surf.end());
-
-            // Update scene AABB & surfaceIdxs (used for indirection in BVH)
-            int c = 0;
-            for (auto& s : surf) {
-                this->bbox.min = Vector3f(std::min(this->bbox.min.x, s.bbox.min.x),
-                    std::min(this->bbox.min.y, s.bbox.min.y),
-                    std::min(this->bbox.min.z, s.bbox.min.z));
-
-                this->bbox.max = Vector3f(std::max(this->bbox.max.x, s.bbox.max.x),
-                    std::max(this->bbox.max.y, s.bbox.max.y),
-                    std::max(this->bbox.max.z, s.bbox.max.z));
+        for (std::string surfacePath : surfacePaths)
+            this->addInstances(sceneDirectory + "/" + surfacePath, Transform());
+    }
+    catch (nlohmann::json::exception e) {
+        std::cout << "No surfaces defined." << std::endl;
+    }
 
-                // Update indirection indices for BVH
-                this->surfaceIdxs.push_back(surfaceIdx + c);
-                c += 1;
+    // Instances: more copies of a surface file, each placed with its own transform. Either a
+    // "transform" of 12 or 16 numbers (a row-major matrix) or any of "translate", "rotate"
+    // ([degrees, axis x, y, z]) and "scale" (a number or one per axis), applied scale first.
+    try {
+        auto& instanceConfigs = sceneConfig["instances"];
+
+        for (auto& instanceConfig : instanceConfigs) {
+            std::string surfacePath = sceneDirectory + "/" + std::string(instanceConfig["surface"]);
+
+            Transform objectToWorld;
+            if (instanceConfig.contains("transform")) {
+                auto& matrix = instanceConfig["transform"];
+                if (matrix.size() != 12 && matrix.size() != 16) {
+                    std::cerr << "Instance transform of " << surfacePath << " should have 12 or 16 entries." << std::endl;
+                    exit(1);
+                }
+                for (int i = 0; i < 3; i++)
+                    for (int j = 0; j < 4; j++)
+                        objectToWorld.m[i][j] = matrix[i * 4 + j];
+            }
+            else {
+                if (instanceConfig.contains("scale")) {
+                    auto& scale = instanceConfig["scale"];
+                    Vector3f s = scale.is_number() ? Vector3f(scale, scale, scale) : Vector3f(scale[0], scale[1], scale[2]);
+                    objectToWorld = Transform::scale(s);
+                }
+                if (instanceConfig.contains("rotate")) {
+                    auto& rotate = instanceConfig["rotate"];
+                    objectToWorld = Transform::rotate(rotate[0], Vector3f(rotate[1], rotate[2], rotate[3])) * objectToWorld;
+                }
+                if (instanceConfig.contains("translate")) {
+                    auto& translate = instanceConfig["translate"];
+                    objectToWorld = Transform::translate(Vector3f(translate[0], translate[1], translate[2])) * objectToWorld;
+                }
             }
 
-            surfaceIdx = surfaceIdx + surf.size();
-        }
+            if (objectToWorld.determinant() == 0.f) {
+                std::cerr << "Instance transform of " << surfacePath << " is not invertible." << std::endl;
+                exit(1);
+            }
 
-        // Allocate memory for BVH based on max
-        this->nodes = (BVHNode*) malloc((2 * this->surfaceIdxs.size() - 1) * sizeof(BVHNode));
-        for (int i = 0; i < 2 * this->surfaceIdxs.size() - 1; i++) {
-            this->nodes[i] = BVHNode();
+            this->addInstances(surfacePath, objectToWorld);
         }
     }
     catch (nlohmann::json::exception e) {
-        std::cout << "No surfaces defined." << std::endl;
+        std::cerr << "Could not parse \"instances\": " << e.what() << std::endl;
+        exit(1);
     }
 
+    // Allocate memory for BVH based on max
+    this->nodes = (BVHNode*) malloc((2 * this->instanceIdxs.size() - 1) * sizeof(BVHNode));
+    for (int i = 0; i < 2 * this->instanceIdxs.size() - 1; i++) {
+        this->nodes[i] = BVHNode();
+    }
+
+    // Build the surface BVHs, all files at once so that small surfaces run side by side and large
+    // ones split their subtrees over the remaining threads
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    int buildThreads = bvhSettings.buildThreads > 0 ? bvhSettings.buildThreads : defaultThreadCount();
+    parallelFor(this->surfaces.size(), buildThreads, [&](int i) {
+        // Surfaces from the mesh cache come with their BVH
+        if (this->surfaces[i].numBVHNodes == 0)
+            this->surfaces[i].buildBVH(*this->arena);
+    });
+
     // Build the BVH
     this->buildBVH();
+    auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - buildStart).count();
+
+    if (!bvhSettings.cacheDirectory.empty()) {
+        int written = 0;
+        for (auto& miss : this->cacheMisses) {
+            auto range = this->surfaceRanges[miss.first];
+            written += saveMeshCache(miss.second, &this->surfaces[range.first], range.second);
+        }
+        std::cout << "Mesh cache: " << this->surfaceRanges.size() - this->cacheMisses.size() << " of "
+            << this->surfaceRanges.size() << " files loaded, " << written << " written to " << bvhSettings.cacheDirectory << std::endl;
+    }
+
+    // The images have been decoding since their materials were parsed; this is the first point that needs them
+    auto textureStart = std::chrono::high_resolution_clock::now();
+    this->textures->wait();
+    for (auto& surf : this->surfaces) {
+        if (surf.diffuseTexturePath != "")
+            surf.diffuseTexture = this->textures->get(surf.diffuseTexturePath);
+        if (surf.alphaTexturePath != "")
+            surf.alphaTexture = this->textures->get(surf.alphaTexturePath);
+    }
+    auto textureWait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - textureStart).count();
+
+    // Report tree quality and size so the builders and node formats can be compared on the same scene
+    int surfaceNodes = 0, wideNodes = 0;
+    float surfaceCost = 0.f;
+    for (auto& surf : this->surfaces) {
+        surfaceNodes += surf.numBVHNodes;
+        surfaceCost += computeSAHCost(surf.nodes, surf.numBVHNodes);
+#if BVH_WIDTH > 2
+        wideNodes += surf.numWideNodes;
+#endif
+    }
+    std::cout << "BVH (" << bvhBuilderName(bvhSettings.builder) << "): "
+        << "scene " << this->numBVHNodes << " nodes over " << this->instances.size() << " instances of "
+        << this->surfaces.size() << " surfaces, SAH cost " << computeSAHCost(this->nodes, this->numBVHNodes) << "; "
+        << "surfaces " << surfaceNodes << " nodes, total SAH cost " << surfaceCost;
+#if BVH_WIDTH > 2
+    std::cout << ", collapsed to " << wideNodes << " " << BVH_WIDTH << "-wide nodes";
+#endif
+    std::cout << std::endl;
+
+    std::cout << "BVH node memory: binary " << (this->numBVHNodes + surfaceNodes) * sizeof(BVHNode) / 1024.f << " KB"
+        << " (" << sizeof(BVHNode) << " B/node)";
+#if BVH_WIDTH > 2
+    std::cout << ", " << BVH_WIDTH << "-wide " << wideNodes * sizeof(WideBVHNode<BVH_WIDTH>) / 1024.f << " KB"
+        << " (" << sizeof(WideBVHNode<BVH_WIDTH>) << " B/node)";
+#endif
+    std::cout << std::endl;
+
+    std::cout << "BVH build time: " << buildTime / 1000.f << " ms (" << buildThreads << " threads)" << std::endl;
+    if (this->textures->size() > 0)
+        std::cout << "Texture decoding: waited " << textureWait / 1000.f << " ms after the BVH build" << std::endl;
+
+    std::cout << "Scene memory: " << this->arena->bytesAllocated() / (1024.f * 1024.f) << " MB allocated in "
+        << this->arena->bytesReserved() / (1024.f * 1024.f) << " MB of arena chunks"
+        << (Arena::useHugePages ? " (huge pages)" : "") << ", "
+        << this->arena->bytesMapped() / (1024.f * 1024.f) << " MB mapped from the mesh cache" << std::endl;
+
+    // Scenes and surfaces cannot be copied; what is left is moving compacted BVHs and decoded images into the arena
+    std::cout << "Load copies: " << this->arena->bytesCopied() / (1024.f * 1024.f) << " MB" << std::endl;
+
+    this->textures->report();
+}
+
+void Scene::compareBuilders()
+{
+    int buildThreads = bvhSettings.buildThreads > 0 ? bvhSettings.buildThreads : defaultThreadCount();
+    BVHBuilder builder = bvhSettings.builder;
+
+    std::cout << "BVH builders on " << this->surfaces.size() << " surfaces (" << buildThreads << " threads):" << std::endl;
+    std::cout << "  builder     build ms    SAH cost       nodes" << std::endl;
+    for (int b = 0; b < NUM_BVH_BUILDERS; b++) {
+        bvhSettings.builder = BVHBuilder(b);
+
+        // Builds into an arena of its own on surfaces that share nothing with these but the geometry
+        std::vector<Surface> copies;
+        for (auto& surf : this->surfaces)
+            copies.push_back(surf.cloneGeometry());
+        Arena arena;
+        auto start = std::chrono::high_resolution_clock::now();
+        parallelFor(copies.size(), buildThreads, [&](int i) {
+            copies[i].buildBVH(arena);
+        });
+        auto buildTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+        float cost = 0.f;
+        int numNodes = 0;
+        for (auto& surf : copies) {
+            cost += computeSAHCost(surf.nodes, surf.numBVHNodes);
+            numNodes += surf.numBVHNodes;
+        }
+
+        std::cout << "  " << std::left << std::setw(10) << bvhBuilderName(BVHBuilder(b)) << std::right << std::fixed
+            << std::setprecision(2) << std::setw(10) << buildTime / 1000.f
+            << std::setprecision(3) << std::setw(12) << cost
+            << std::setw(12) << numNodes << std::defaultfloat << std::endl;
+    }
+
+    bvhSettings.builder = builder;
+}
+
+void Scene::addInstances(std::string surfacePath, const Transform& objectToWorld)
+{
+    // Load the file the first time it is referenced; later instances share its surfaces and BVHs
+    if (this->surfaceRanges.find(surfacePath) == this->surfaceRanges.end()) {
+        uint32_t surfaceIdx = this->surfaces.size();
+        std::vector<Surface> surf;
+
+        bool cached = false;
+        if (!bvhSettings.cacheDirectory.empty()) {
+            uint64_t key = meshCacheKey(surfacePath);
+            cached = key != 0 && loadMeshCache(key, /*isLight=*/false, /*idx=*/surfaceIdx, surf, *this->arena, *this->textures);
+            if (key != 0 && !cached)
+                this->cacheMisses.push_back(std::make_pair(surfacePath, key));
+        }
+        if (!cached)
+            surf = createSurfaces(surfacePath, /*isLight=*/false, /*idx=*/surfaceIdx, *this->arena, *this->textures);
+        this->surfaces.insert(this->surfaces.end(), std::make_move_iterator(surf.begin()), std::make_move_iterator(surf.end()));
+        this->surfaceRanges[surfacePath] = std::make_pair(surfaceIdx, uint32_t(surf.size()));
+    }
+
+    auto range = this->surfaceRanges[surfacePath];
+    for (uint32_t i = 0; i < range.second; i++) {
+        Instance instance;
+        instance.surfaceIdx = range.first + i;
+        instance.objectToWorld = objectToWorld;
+        instance.worldToObject = objectToWorld.inverse();
+        instance.identity = objectToWorld.isIdentity();
+        instance.bbox = objectToWorld.bounds(this->surfaces[instance.surfaceIdx].bbox);
+
+        // Update scene AABB & instanceIdxs (used for indirection in BVH)
+        this->bbox.grow(instance.bbox);
+        this->instanceIdxs.push_back(this->instances.size());
+        this->instances.push_back(instance);
+    }
 }
 
 void Scene::buildBVH()
@@ -128,15 +321,20 @@ void Scene::buildBVH()
 
     BVHNode& rootNode = this->nodes[0];
     rootNode.firstPrim = 0;
-    rootNode.primCount = this->surfaceIdxs.size();
+    rootNode.primCount = this->instanceIdxs.size();
 
     this->updateNodeBounds(0);
     this->subdivideNode(0);
+
+    // The builder allocates for the worst case of one instance per leaf; keep only the nodes used
+    BVHNode* scratch = this->nodes;
+    this->nodes = this->arena->copy(scratch, this->numBVHNodes);
+    free(scratch);
 }
 
 uint32_t Scene::getIdx(uint32_t idx)
 {
-    return this->surfaceIdxs[idx];
+    return this->instanceIdxs[idx];
 }
 
 void Scene::updateNodeBounds(uint32_t nodeIdx)
@@ -144,20 +342,18 @@ void Scene::updateNodeBounds(uint32_t nodeIdx)
     BVHNode& node = this->nodes[nodeIdx];
 
     for (int i = 0; i < node.primCount; i++) {
-        auto surf = this->surfaces[this->getIdx(i + node.firstPrim)];
+        const Instance& instance = this->instances[this->getIdx(i + node.firstPrim)];
         node.bbox.min = Vector3f(
-            std::min(node.bbox.min.x, surf.bbox.min.x),
-            std::min(node.bbox.min.y, surf.bbox.min.y),
-            std::min(node.bbox.min.z, surf.bbox.min.z)
+            std::min(node.bbox.min.x, instance.bbox.min.x),
+            std::min(node.bbox.min.y, instance.bbox.min.y),
+            std::min(node.bbox.min.z, instance.bbox.min.z)
         );
 
         node.bbox.max = Vector3f(
-            std::max(node.bbox.max.x, surf.bbox.max.x),
-            std::max(node.bbox.max.y, surf.bbox.max.y),
-            std::max(node.bbox.max.z, surf.bbox.max.z)
+            std::max(node.bbox.max.x, instance.bbox.max.x),
+            std::max(node.bbox.max.y, instance.bbox.max.y),
+            std::max(node.bbox.max.z, instance.bbox.max.z)
         );
-
-        node.bbox.centroid = (node.bbox.min + node.bbox.max) / 2.f;
     }
 }
 
@@ -167,23 +363,48 @@ void Scene::subdivideNode(uint32_t nodeIdx)
 
     if (node.primCount <= 1) return;
 
-    Vector3f extent = node.bbox.max - node.bbox.min;
-
-    int ax = 0;
-    if (extent.y > extent.x) ax = 1;
-    if (extent.z > extent[ax]) ax = 2;
-    float split = node.bbox.min[ax] + extent[ax] * 0.5f;
-
     int i = node.firstPrim;
     int j = i + node.primCount - 1;
 
-    while(i <= j) {
-        if (this->surfaces[this->getIdx(i)].bbox.centroid[ax] < split)
-            i++;
-        else {
-            auto temp = this->surfaceIdxs[i];
-            this->surfaceIdxs[i] = this->surfaceIdxs[j];
-            this->surfaceIdxs[j--] = temp;
+    // Only surfaces have an LBVH builder; the scene level is small enough for SAH
+    if (bvhSettings.builder != BVH_MIDPOINT) {
+        SAHSplit split = findSAHSplit(node,
+            [&](uint32_t k) -> const AABB& { return this->instances[this->getIdx(k)].bbox; },
+            [&](uint32_t k) { return this->instances[this->getIdx(k)].bbox.centroid(); }
+        );
+
+        // Keep the node as a leaf if splitting does not pay off (unless it holds too many primitives),
+        // or if all centroids coincide and there is nothing to split
+        float leafCost = bvhSettings.intersectionCost * node.primCount;
+        if (split.axis == -1) return;
+        if (split.cost >= leafCost && node.primCount <= bvhSettings.maxLeafSize) return;
+
+        while (i <= j) {
+            if (split.binOf(this->instances[this->getIdx(i)].bbox.centroid()) < split.bin)
+                i++;
+            else {
+                auto temp = this->instanceIdxs[i];
+                this->instanceIdxs[i] = this->instanceIdxs[j];
+                this->instanceIdxs[j--] = temp;
+            }
+        }
+    }
+    else {
+        Vector3f extent = node.bbox.max - node.bbox.min;
+
+        int ax = 0;
+        if (extent.y > extent.x) ax = 1;
+        if (extent.z > extent[ax]) ax = 2;
+        float split = node.bbox.min[ax] + extent[ax] * 0.5f;
+
+        while(i <= j) {
+            if (this->instances[this->getIdx(i)].bbox.centroid()[ax] < split)
+                i++;
+            else {
+                auto temp = this->instanceIdxs[i];
+                this->instanceIdxs[i] = this->instanceIdxs[j];
+                this->instanceIdxs[j--] = temp;
+            }
         }
     }
 
@@ -210,34 +431,127 @@ void Scene::subdivideNode(uint32_t nodeIdx)
     this->subdivideNode(ridx);
 }
 
-void Scene::intersectBVH(uint32_t nodeIdx, Ray &ray, Interaction& si)
+void Scene::intersectBVH(Ray &ray, HitRecord& hit, TraversalStats* stats)
 {
-    BVHNode& node = this->nodes[nodeIdx];
+    traverseBVH(this->nodes, ray, [&](uint32_t firstPrim, uint32_t primCount) {
+        for (uint32_t i = 0; i < primCount; i++) {
+            uint32_t instanceIdx = this->getIdx(i + firstPrim);
+            if (this->intersectInstance(instanceIdx, ray, hit, stats))
+                hit.instanceIdx = instanceIdx;
+        }
+        return false;
+    }, stats);
+}
+
+bool Scene::intersectInstance(uint32_t instanceIdx, Ray& ray, HitRecord& hit, TraversalStats* stats)
+{
+    const Instance& instance = this->instances[instanceIdx];
+    Surface& surf = this->surfaces[instance.surfaceIdx];
+    if (instance.identity) return surf.rayIntersect(ray, hit, stats);
 
-    if (!node.bbox.intersects(ray)) return;
+    Ray objectRay = instance.toObject(ray);
+    if (!surf.rayIntersect(objectRay, hit, stats)) return false;
 
-    if (node.primCount != 0) {
-        // Leaf
-        for (uint32_t i = 0; i < node.primCount; i++) {
-            Interaction siIntermediate = this->surfaces[this->getIdx(i + node.firstPrim)].rayIntersect(ray);
-            if (siIntermediate.t <= ray.t) {
-                si = siIntermediate;
-                ray.t = si.t;
-            }
+    ray.t = objectRay.t;
+    return true;
+}
+
+Interaction Scene::rayIntersect(Ray& ray)
+{
+    HitRecord hit;
+    this->intersectBVH(ray, hit);
+
+    return this->computeInteraction(ray, hit);
+}
+
+Interaction Scene::computeInteraction(const Ray& ray, const HitRecord& hit)
+{
+    if (!hit.didIntersect()) return Interaction();
+
+    // The hit point comes from the world-space ray; only the normal needs moving out of object space
+    const Instance& instance = this->instances[hit.instanceIdx];
+    Surface& surf = this->surfaces[instance.surfaceIdx];
+    Interaction si = surf.computeInteraction(ray, hit);
+    if (!instance.identity) si.n = Normalize(instance.worldToObject.normal(si.n));
+
+    if (ray.hasDifferentials) {
+        if (instance.identity)
+            surf.computeDifferentials(ray, hit, si);
+        else {
+            Ray objectRay = instance.toObject(ray);
+            objectRay.dDdx = instance.worldToObject.vector(ray.dDdx);
+            objectRay.dDdy = instance.worldToObject.vector(ray.dDdy);
+            surf.computeDifferentials(objectRay, hit, si);
         }
     }
-    else {
-        this->intersectBVH(node.left, ray, si);
-        this->intersectBVH(node.right, ray, si);
+
+    return si;
+}
+
+void Scene::intersectPacket(RayPacket& packet, TraversalStats* stats)
+{
+    if (!packet.coherent) {
+        for (size_t i = 0; i < packet.rays.size(); i++)
+            this->intersectBVH(packet.rays[i], packet.hits[i], stats);
+        return;
     }
+
+    traversePacketBVH<2>(packet, 0, int(packet.rays.size()) - 1, [&](uint32_t idx, PacketEntry* children) {
+        return expandBVHNode(this->nodes, idx, children);
+    }, [&](const PacketEntry& entry) {
+        for (uint32_t i = 0; i < entry.primCount; i++)
+            this->intersectInstancePacket(this->getIdx(i + entry.idx), packet, entry.first, entry.last, stats);
+    }, stats);
 }
 
-Interaction Scene::rayIntersect(Ray& ray)
+void Scene::intersectInstancePacket(uint32_t instanceIdx, RayPacket& packet, int first, int last, TraversalStats* stats)
 {
-    Interaction si;
-    si.didIntersect = false;
+    const Instance& instance = this->instances[instanceIdx];
+    Surface& surf = this->surfaces[instance.surfaceIdx];
+    if (instance.identity) {
+        surf.intersectPacket(packet, first, last, instanceIdx, stats);
+        return;
+    }
 
-    this->intersectBVH(0, ray, si);
+    // Transformed copies of the rays form a packet of their own; a rotation can make it incoherent
+    thread_local RayPacket objectPacket;
+    objectPacket.rays.clear();
+    for (int r = first; r <= last; r++)
+        objectPacket.rays.push_back(instance.toObject(packet.rays[r]));
+    objectPacket.prepare();
 
-    return si;
-}
\ No newline at end of file
+    int numRays = last - first + 1;
+    if (objectPacket.coherent)
+        surf.intersectPacket(objectPacket, 0, numRays - 1, instanceIdx, stats);
+    else {
+        for (int i = 0; i < numRays; i++) {
+            if (surf.rayIntersect(objectPacket.rays[i], objectPacket.hits[i], stats))
+                objectPacket.hits[i].instanceIdx = instanceIdx;
+        }
+    }
+
+    for (int i = 0; i < numRays; i++) {
+        if (!objectPacket.hits[i].didIntersect()) continue;
+        packet.hits[first + i] = objectPacket.hits[i];
+        packet.rays[first + i].t = objectPacket.rays[i].t;
+    }
+}
+
+bool Scene::occluded(Ray ray, float tmax, TraversalStats* stats)
+{
+    // Traversal culls against ray.t, so clip it to the query range once up front
+    ray.tmax = std::min(ray.tmax, tmax);
+    ray.t = std::min(ray.t, ray.tmax);
+
+    bool blocked = false;
+    traverseBVH(this->nodes, ray, [&](uint32_t firstPrim, uint32_t primCount) {
+        for (uint32_t i = 0; i < primCount && !blocked; i++) {
+            const Instance& instance = this->instances[this->getIdx(i + firstPrim)];
+            Surface& surf = this->surfaces[instance.surfaceIdx];
+            blocked = instance.identity ? surf.occluded(ray, stats) : surf.occluded(instance.toObject(ray), stats);
+        }
+        return blocked;
+    }, stats);
+
+    return blocked;
+}
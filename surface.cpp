@@ -1,9 +1,28 @@
 #include "surface.h"
+#include "parallel.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tinyobjloader/tiny_obj_loader.h"
 
-std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx)
+#include <unordered_map>
+
+struct VertexKey {
+    int vertex, normal, texcoord;
+
+    bool operator==(const VertexKey& other) const
+    {
+        return vertex == other.vertex && normal == other.normal && texcoord == other.texcoord;
+    }
+};
+
+struct VertexKeyHash {
+    size_t operator()(const VertexKey& key) const
+    {
+        return size_t(key.vertex) * 0x9e3779b1u ^ size_t(key.normal) * 0x85ebca6bu ^ size_t(key.texcoord) * 0xc2b2ae35u;
+    }
+};
+
+std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_t shapeIdx, Arena& arena, TextureRegistry& textures)
 {
     std::string objDirectory;
     const size_t last_slash_idx = pathToObj.rfind('/');
@@ -35,8 +54,17 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
         Surface surf;
         surf.isLight = isLight;
         surf.shapeIdx = shapeIdx;
+        surf.numTris = shapes[s].mesh.num_face_vertices.size();
+        surf.tris = arena.allocate<Tri>(surf.numTris);
         std::set<int> materialIds;
 
+        // tinyobj indexes positions, normals and uvs separately; every distinct combination of the
+        // three becomes one vertex of the surface, shared by all faces that use it. The faces are
+        // indexed first, so the vertex buffers can be allocated at their final size and filled in place.
+        std::unordered_map<VertexKey, uint32_t, VertexKeyHash> welded;
+        welded.reserve(surf.numTris);
+        std::vector<VertexKey> weldedKeys;
+
         // Loop over faces(polygon)
         size_t index_offset = 0;
         for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
@@ -47,105 +75,61 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
             }
 
             // Loop over vertices in the face. Assume 3 vertices per-face
-            Vector3f vertices[3], normals[3];
-            Vector2f uvs[3];
             for (size_t v = 0; v < fv; v++) {
-                // access to vertex
                 tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
-                tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
-                tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
-
-                // Check if `normal_index` is zero or positive. negative = no normal data
-                if (idx.normal_index >= 0) {
-                    tinyobj::real_t nx = attrib.normals[3 * size_t(idx.normal_index) + 0];
-                    tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
-                    tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
+                VertexKey key = {idx.vertex_index, idx.normal_index, idx.texcoord_index};
 
-                    normals[v] = Vector3f(nx, ny, nz);
+                auto found = welded.find(key);
+                if (found != welded.end()) {
+                    surf.tris[f].v[v] = found->second;
+                    continue;
                 }
 
-                // Check if `texcoord_index` is zero or positive. negative = no texcoord data
-                if (idx.texcoord_index >= 0) {
-                    tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
-                    tinyobj::real_t ty = attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
-
-                    uvs[v] = Vector2f(tx, ty);
-                }
-
-                vertices[v] = Vector3f(vx, vy, vz);
+                surf.tris[f].v[v] = weldedKeys.size();
+                welded[key] = weldedKeys.size();
+                weldedKeys.push_back(key);
             }
 
-            int vSize = surf.vertices.size();
-            Vector3i findex(vSize, vSize + 1, vSize + 2);
-
-            surf.vertices.push_back(vertices[0]);
-            surf.vertices.push_back(vertices[1]);
-            surf.vertices.push_back(vertices[2]);
-
-            surf.normals.push_back(normals[0]);
-            surf.normals.push_back(normals[1]);
-            surf.normals.push_back(normals[2]);
-
-            surf.uvs.push_back(uvs[0]);
-            surf.uvs.push_back(uvs[1]);
-            surf.uvs.push_back(uvs[2]);
-
-            surf.indices.push_back(findex);
-
-            // Create Triangle
-            Tri triangle;
-            triangle.v1 = vertices[0];
-            triangle.v2 = vertices[1];
-            triangle.v3 = vertices[2];
-
-            triangle.uv1 = uvs[0];
-            triangle.uv2 = uvs[1];
-            triangle.uv3 = uvs[2];
-
-            triangle.normal = Normalize(normals[0] + normals[1] + normals[2]);
-            triangle.centroid = (triangle.v1 + triangle.v2 + triangle.v3) / 3.f;
-
-            for (int i = 0; i < 3; i++) {
-                triangle.bbox.min = Vector3f(
-                    std::min(triangle.bbox.min.x, vertices[i].x),
-                    std::min(triangle.bbox.min.y, vertices[i].y),
-                    std::min(triangle.bbox.min.z, vertices[i].z)
-                );
+            // per-face material
+            materialIds.insert(shapes[s].mesh.material_ids[f]);
 
-                triangle.bbox.max = Vector3f(
-                    std::max(triangle.bbox.max.x, vertices[i].x),
-                    std::max(triangle.bbox.max.y, vertices[i].y),
-                    std::max(triangle.bbox.max.z, vertices[i].z)
-                );
+            index_offset += fv;
+        }
 
-                triangle.bbox.centroid = (triangle.bbox.min + triangle.bbox.max) / 2.f;
+        surf.numVertices = weldedKeys.size();
+        surf.vertices = arena.allocate<Vector3f>(surf.numVertices);
+        surf.normals = arena.allocate<Vector3f>(surf.numVertices);
+        surf.uvs = arena.allocate<Vector2f>(surf.numVertices);
+        for (uint32_t v = 0; v < surf.numVertices; v++) {
+            const VertexKey& key = weldedKeys[v];
+
+            // access to vertex
+            tinyobj::real_t vx = attrib.vertices[3 * size_t(key.vertex) + 0];
+            tinyobj::real_t vy = attrib.vertices[3 * size_t(key.vertex) + 1];
+            tinyobj::real_t vz = attrib.vertices[3 * size_t(key.vertex) + 2];
+            surf.vertices[v] = Vector3f(vx, vy, vz);
+            surf.normals[v] = Vector3f();
+            surf.uvs[v] = Vector2f();
+
+            // Check if `normal_index` is zero or positive. negative = no normal data
+            if (key.normal >= 0) {
+                tinyobj::real_t nx = attrib.normals[3 * size_t(key.normal) + 0];
+                tinyobj::real_t ny = attrib.normals[3 * size_t(key.normal) + 1];
+                tinyobj::real_t nz = attrib.normals[3 * size_t(key.normal) + 2];
+
+                surf.normals[v] = Vector3f(nx, ny, nz);
             }
 
-            surf.tris.push_back(triangle);
+            // Check if `texcoord_index` is zero or positive. negative = no texcoord data
+            if (key.texcoord >= 0) {
+                tinyobj::real_t tx = attrib.texcoords[2 * size_t(key.texcoord) + 0];
+                tinyobj::real_t ty = attrib.texcoords[2 * size_t(key.texcoord) + 1];
 
-            // BVH indirection indices
-            surf.triIdxs.push_back(f);
+                surf.uvs[v] = Vector2f(tx, ty);
+            }
 
             // Update surface AABB
-            surf.bbox.min = Vector3f(
-                std::min(surf.bbox.min.x, triangle.bbox.min.x),
-                std::min(surf.bbox.min.y, triangle.bbox.min.y),
-                std::min(surf.bbox.min.z, triangle.bbox.min.z)
-            );
-
-            surf.bbox.max = Vector3f(
-                std::max(surf.bbox.max.x, triangle.bbox.max.x),
-                std::max(surf.bbox.max.y, triangle.bbox.max.y),
-                std::max(surf.bbox.max.z, triangle.bbox.max.z)
-            );
-
-            surf.bbox.centroid = (surf.bbox.min + surf.bbox.max) / 2.f;
-
-            // per-face material
-            materialIds.insert(shapes[s].mesh.material_ids[f]);
-
-            index_offset += fv;
+            surf.bbox.grow(surf.vertices[v]);
         }
 
         if (materialIds.size() > 1) {
@@ -161,39 +145,57 @@ std::vector<Surface> createSurfaces(std::string pathToObj, bool isLight, uint32_
             // Load textures from Materials
             auto matId = *materialIds.begin();
             if (matId != -1) {
-                auto mat = materials[matId];
+                const auto& mat = materials[matId];
 
                 surf.diffuse = Vector3f(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
-                if (mat.diffuse_texname != "")
-                    surf.diffuseTexture = Texture(objDirectory + "/" + mat.diffuse_texname);
+                if (mat.diffuse_texname != "") {
+                    surf.diffuseTexturePath = objDirectory + "/" + mat.diffuse_texname;
+                    textures.request(surf.diffuseTexturePath, arena);
+                }
 
                 surf.alpha = mat.specular[0];
-                if (mat.alpha_texname != "")
-                    surf.alphaTexture = Texture(objDirectory + "/" + mat.alpha_texname);
+                if (mat.alpha_texname != "") {
+                    surf.alphaTexturePath = objDirectory + "/" + mat.alpha_texname;
+                    textures.request(surf.alphaTexturePath, arena);
+                }
             } else {
                 // Assign a default diffuse color of (1,1,1)
                 surf.diffuse = Vector3f(1, 1, 1);
             }
         }
 
-        // Allocate memory for BVH & build the BVH
-        surf.nodes = (BVHNode*)malloc((2 * surf.triIdxs.size() - 1) * sizeof(BVHNode));
-        for (int i = 0; i < 2 * surf.triIdxs.size() - 1; i++) {
-            surf.nodes[i] = BVHNode();
-        }
-
-        surf.buildBVH();
-
-        surfaces.push_back(surf);
+        // The Scene builds the BVHs of all surfaces at once, in parallel
+        surfaces.push_back(std::move(surf));
         shapeIdx++;
     }
 
     return surfaces;
 }
 
-bool Surface::hasDiffuseTexture() { return this->diffuseTexture.data != 0; }
+Surface Surface::cloneGeometry() const
+{
+    Surface surf;
+    surf.vertices = this->vertices;
+    surf.normals = this->normals;
+    surf.uvs = this->uvs;
+    surf.numVertices = this->numVertices;
+    surf.tris = this->tris;
+    surf.numTris = this->numTris;
+    surf.bbox = this->bbox;
+    surf.isLight = this->isLight;
+    surf.shapeIdx = this->shapeIdx;
+    surf.diffuse = this->diffuse;
+    surf.alpha = this->alpha;
+    surf.diffuseTexture = this->diffuseTexture;
+    surf.alphaTexture = this->alphaTexture;
+    surf.diffuseTexturePath = this->diffuseTexturePath;
+    surf.alphaTexturePath = this->alphaTexturePath;
+    return surf;
+}
 
-bool Surface::hasAlphaTexture() { return this->alphaTexture.data != 0; }
+bool Surface::hasDiffuseTexture() { return this->diffuseTexture.isLoaded(); }
+
+bool Surface::hasAlphaTexture() { return this->alphaTexture.isLoaded(); }
 
 Interaction Surface::rayPlaneIntersect(Ray ray, Vector3f p, Vector3f n)
 {
@@ -214,76 +216,320 @@ Interaction Surface::rayPlaneIntersect(Ray ray, Vector3f p, Vector3f n)
     return si;
 }
 
-Interaction Surface::rayTriangleIntersect(Ray ray, Vector3f v1, Vector3f v2, Vector3f v3, Vector3f n)
+// Moller-Trumbore: solves for t and the barycentrics directly, without going through the plane
+bool Surface::rayTriangleIntersect(const Ray& ray, uint32_t triIdx, HitRecord& hit)
 {
-    Interaction si = this->rayPlaneIntersect(ray, v1, n);
+    const Tri& tri = this->tris[triIdx];
+    Vector3f v1 = this->vertices[tri.v[0]], v2 = this->vertices[tri.v[1]], v3 = this->vertices[tri.v[2]];
 
-    if (si.didIntersect) {
-        bool edge1 = false, edge2 = false, edge3 = false;
+    Vector3f e1 = v2 - v1;
+    Vector3f e2 = v3 - v1;
+    Vector3f pvec = Cross(ray.d, e2);
+    float det = Dot(e1, pvec);
+    if (std::abs(det) < 1e-12f) return false;  // Ray is parallel to the triangle
 
-        // Check edge 1
-        {
-            Vector3f nIp = Cross((si.p - v1), (v3 - v1));
-            Vector3f nTri = Cross((v2 - v1), (v3 - v1));
-            edge1 = Dot(nIp, nTri) > 0;
-        }
+    float invDet = 1.f / det;
+    Vector3f tvec = ray.o - v1;
+    float b1 = Dot(tvec, pvec) * invDet;
+    if (b1 < 0.f || b1 > 1.f) return false;
 
-        // Check edge 2
-        {
-            Vector3f nIp = Cross((si.p - v1), (v2 - v1));
-            Vector3f nTri = Cross((v3 - v1), (v2 - v1));
-            edge2 = Dot(nIp, nTri) > 0;
-        }
+    Vector3f qvec = Cross(tvec, e1);
+    float b2 = Dot(ray.d, qvec) * invDet;
+    if (b2 < 0.f || b1 + b2 > 1.f) return false;
 
-        // Check edge 3
-        {
-            Vector3f nIp = Cross((si.p - v2), (v3 - v2));
-            Vector3f nTri = Cross((v1 - v2), (v3 - v2));
-            edge3 = Dot(nIp, nTri) > 0;
-        }
+    float t = Dot(e2, qvec) * invDet;
+    if (t < 0.f) return false;
 
-        if (edge1 && edge2 && edge3) {
-            // Intersected triangle!
-            si.didIntersect = true;
-            si.triangleIntersected.v1 = v1;
-            si.triangleIntersected.v2 = v2;
-            si.triangleIntersected.v3 = v3;
-
-            // This is buggy. I can imagine a case when two shapes overlap and we don;t know which one to color. Many cases in fact.
-
-            for(Tri triangle : this->tris){
-                if(
-                    triangle.v1 == v1 &&
-                    triangle.v2 == v2 &&
-                    triangle.v3 == v3 
-                    ){
-                        si.triangleIntersected.uv1 = triangle.uv1;
-                        si.triangleIntersected.uv2 = triangle.uv2;
-                        si.triangleIntersected.uv3 = triangle.uv3;
-                    si.intersected_on_surface = this;
-                    break;
-                }
-            }
-        }
-        else {
-            si.didIntersect = false;
+    hit.t = t;
+    hit.primIdx = triIdx;
+    hit.b1 = b1;
+    hit.b2 = b2;
+
+    return true;
+}
+
+TriBlock::TriBlock()
+{
+    for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++) {
+        for (int ax = 0; ax < 3; ax++) {
+            this->v1[ax][lane] = 0.f;
+            this->e1[ax][lane] = 0.f;
+            this->e2[ax][lane] = 0.f;
         }
+        this->triIdx[lane] = NO_HIT;
     }
+}
 
-    return si;
+void TriBlock::setTriangle(int lane, Vector3f v1, Vector3f v2, Vector3f v3, uint32_t idx)
+{
+    Vector3f e1 = v2 - v1;
+    Vector3f e2 = v3 - v1;
+    for (int ax = 0; ax < 3; ax++) {
+        this->v1[ax][lane] = v1[ax];
+        this->e1[ax][lane] = e1[ax];
+        this->e2[ax][lane] = e2[ax];
+    }
+    this->triIdx[lane] = idx;
 }
 
-void Surface::buildBVH()
+// Moller-Trumbore on every lane at once, with the same acceptance tests as rayTriangleIntersect
+int TriBlock::intersect(const Ray& ray, float* t, float* b1, float* b2) const
 {
-    // Root node
-    this->numBVHNodes += 1;
+#if defined(__AVX2__)
+    __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+    __m256 e1x = _mm256_loadu_ps(this->e1[0]), e1y = _mm256_loadu_ps(this->e1[1]), e1z = _mm256_loadu_ps(this->e1[2]);
+    __m256 e2x = _mm256_loadu_ps(this->e2[0]), e2y = _mm256_loadu_ps(this->e2[1]), e2z = _mm256_loadu_ps(this->e2[2]);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.o.x), _mm256_loadu_ps(this->v1[0]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.o.y), _mm256_loadu_ps(this->v1[1]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.o.z), _mm256_loadu_ps(this->v1[2]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+    __m256 dist = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+    // |det| >= 1e-12, 0 <= u <= 1, v >= 0, u + v <= 1, 0 <= t <= ray.t
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
+    __m256 ok = _mm256_cmp_ps(absDet, _mm256_set1_ps(1e-12f), _CMP_GE_OQ);
+    ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+    ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+    ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(dist, zero, _CMP_GE_OQ), _mm256_cmp_ps(dist, _mm256_set1_ps(ray.t), _CMP_LE_OQ)));
+
+    _mm256_storeu_ps(t, dist);
+    _mm256_storeu_ps(b1, u);
+    _mm256_storeu_ps(b2, v);
+    return _mm256_movemask_ps(ok);
+#elif defined(USE_SSE)
+    __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+    __m128 e1x = _mm_loadu_ps(this->e1[0]), e1y = _mm_loadu_ps(this->e1[1]), e1z = _mm_loadu_ps(this->e1[2]);
+    __m128 e2x = _mm_loadu_ps(this->e2[0]), e2y = _mm_loadu_ps(this->e2[1]), e2z = _mm_loadu_ps(this->e2[2]);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.o.x), _mm_loadu_ps(this->v1[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.o.y), _mm_loadu_ps(this->v1[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.o.z), _mm_loadu_ps(this->v1[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+    // |det| >= 1e-12, 0 <= u <= 1, v >= 0, u + v <= 1, 0 <= t <= ray.t
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+    __m128 ok = _mm_cmpge_ps(absDet, _mm_set1_ps(1e-12f));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(dist, zero), _mm_cmple_ps(dist, _mm_set1_ps(ray.t))));
+
+    _mm_storeu_ps(t, dist);
+    _mm_storeu_ps(b1, u);
+    _mm_storeu_ps(b2, v);
+    return _mm_movemask_ps(ok);
+#else
+    // Scalar fallback, in the same float arithmetic as the SIMD paths so all builds agree
+    int mask = 0;
+    for (int lane = 0; lane < TRI_BLOCK_SIZE; lane++) {
+        float e1x = this->e1[0][lane], e1y = this->e1[1][lane], e1z = this->e1[2][lane];
+        float e2x = this->e2[0][lane], e2y = this->e2[1][lane], e2z = this->e2[2][lane];
+
+        float px = ray.d.y * e2z - ray.d.z * e2y;
+        float py = ray.d.z * e2x - ray.d.x * e2z;
+        float pz = ray.d.x * e2y - ray.d.y * e2x;
+        float det = e1x * px + e1y * py + e1z * pz;
+        float invDet = 1.f / det;
+
+        float tx = ray.o.x - this->v1[0][lane], ty = ray.o.y - this->v1[1][lane], tz = ray.o.z - this->v1[2][lane];
+        float u = (tx * px + ty * py + tz * pz) * invDet;
+
+        float qx = ty * e1z - tz * e1y;
+        float qy = tz * e1x - tx * e1z;
+        float qz = tx * e1y - ty * e1x;
+        float v = (ray.d.x * qx + ray.d.y * qy + ray.d.z * qz) * invDet;
+        float dist = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+        t[lane] = dist;
+        b1[lane] = u;
+        b2[lane] = v;
+        if (std::abs(det) >= 1e-12f && u >= 0.f && u <= 1.f && v >= 0.f && u + v <= 1.f && dist >= 0.f && dist <= ray.t)
+            mask |= 1 << lane;
+    }
+    return mask;
+#endif
+}
+
+void Surface::buildBVH(Arena& arena)
+{
+    // BVH indirection indices, and the bounds and centroids the builders sort the triangles by
+    this->triIdxs.resize(this->numTris);
+    this->triBounds.resize(this->numTris);
+    this->triCentroids.resize(this->numTris);
+    for (uint32_t i = 0; i < this->numTris; i++) {
+        const Tri& tri = this->tris[i];
+        Vector3f v1 = this->vertices[tri.v[0]], v2 = this->vertices[tri.v[1]], v3 = this->vertices[tri.v[2]];
+
+        this->triIdxs[i] = i;
+        this->triBounds[i].grow(v1);
+        this->triBounds[i].grow(v2);
+        this->triBounds[i].grow(v3);
+        this->triCentroids[i] = (v1 + v2 + v3) / 3.f;
+    }
 
+    // Build in scratch memory sized for the worst case, then keep only the nodes used
+    this->nodes = (BVHNode*)malloc((2 * this->triIdxs.size() - 1) * sizeof(BVHNode));
+    for (int i = 0; i < 2 * this->triIdxs.size() - 1; i++) {
+        this->nodes[i] = BVHNode();
+    }
+
+    // Root node
     BVHNode& rootNode = this->nodes[0];
     rootNode.firstPrim = 0;
     rootNode.primCount = this->triIdxs.size();
 
-    this->updateNodeBounds(0);
-    this->subdivideNode(0);
+    if (bvhSettings.builder == BVH_LBVH)
+        this->buildLBVH();
+    else {
+        this->updateNodeBounds(0);
+        this->subdivideNode(0);
+    }
+
+    // The builder allocates for the worst case of one primitive per leaf and leaves gaps where
+    // leaves hold more; close them and move the tree into the arena
+    this->numBVHNodes = compactBVH(this->nodes);
+    BVHNode* scratch = this->nodes;
+    this->nodes = arena.copy(scratch, this->numBVHNodes);
+    free(scratch);
+
+    this->packTriangles(arena);
+    std::vector<uint32_t>().swap(this->triIdxs);
+    std::vector<AABB>().swap(this->triBounds);
+    std::vector<Vector3f>().swap(this->triCentroids);
+
+#if BVH_WIDTH > 2
+    std::vector<WideBVHNode<BVH_WIDTH>> wide;
+    collapseBVH(this->nodes, 0, wide);
+
+    this->numWideNodes = wide.size();
+    this->wideNodes = arena.copy(wide.data(), wide.size());
+#endif
+}
+
+// Sorts the triangles along a Morton curve over their centroids and builds the tree top-down by
+// splitting at the highest bit where the codes of a node differ. Every node costs a binary search,
+// and bounds are gathered bottom-up, so the build is close to linear in the triangle count.
+void Surface::buildLBVH()
+{
+    int numThreads = bvhSettings.buildThreads > 0 ? bvhSettings.buildThreads : defaultThreadCount();
+    uint32_t numTris = this->numTris;
+
+    AABB centroidBounds;
+    for (uint32_t i = 0; i < numTris; i++)
+        centroidBounds.grow(this->triCentroids[i]);
+
+    Vector3f extent = centroidBounds.max - centroidBounds.min;
+    for (int ax = 0; ax < 3; ax++)
+        extent[ax] = extent[ax] > 0.f ? 1.f / extent[ax] : 0.f;
+
+    int bitsPerAxis = numTris > LBVH_LONG_CODE_THRESHOLD ? 21 : 10;
+    std::vector<uint64_t> codes(numTris);
+    std::vector<uint32_t> order(numTris);
+    int numChunks = std::max(1, std::min<int>(numThreads, numTris / 16384));
+    parallelFor(numChunks, numThreads, [&](int c) {
+        for (uint32_t i = c * numTris / numChunks; i < (c + 1) * numTris / numChunks; i++) {
+            Vector3f p = this->triCentroids[i] - centroidBounds.min;
+            codes[i] = mortonCode(Vector3f(p.x * extent.x, p.y * extent.y, p.z * extent.z), bitsPerAxis);
+            order[i] = i;
+        }
+    });
+
+    radixSort(codes, order, 3 * bitsPerAxis, numThreads);
+    this->triIdxs = order;
+
+    this->emitLBVH(0, codes.data());
+}
+
+// Same implicit child slots as subdivideNode, so large subtrees are also built on other threads
+void Surface::emitLBVH(uint32_t nodeIdx, const uint64_t* codes)
+{
+    BVHNode& node = this->nodes[nodeIdx];
+
+    if (node.primCount <= bvhSettings.maxLeafSize) {
+        this->updateNodeBounds(nodeIdx);
+        return;
+    }
+
+    uint32_t first = node.firstPrim, last = node.firstPrim + node.primCount - 1;
+    uint32_t leftCount = findMortonSplit(codes, first, last) - first + 1;
+
+    uint32_t lidx = nodeIdx + 1;
+    BVHNode& left = this->nodes[lidx];
+    left.firstPrim = first;
+    left.primCount = leftCount;
+
+    uint32_t ridx = nodeIdx + 2 * leftCount;
+    BVHNode& right = this->nodes[ridx];
+    right.firstPrim = first + leftCount;
+    right.primCount = node.primCount - leftCount;
+
+    if (node.primCount >= PARALLEL_BUILD_THRESHOLD) {
+        int numThreads = bvhSettings.buildThreads > 0 ? bvhSettings.buildThreads : defaultThreadCount();
+        parallelInvoke(numThreads, [&]() { this->emitLBVH(lidx, codes); }, [&]() { this->emitLBVH(ridx, codes); });
+    }
+    else {
+        this->emitLBVH(lidx, codes);
+        this->emitLBVH(ridx, codes);
+    }
+
+    node.bbox = left.bbox;
+    node.bbox.grow(right.bbox);
+    node.left = lidx;
+    node.right = ridx;
+    node.primCount = 0;
+}
+
+// Copies the triangles of every leaf into TriBlocks, in node order so neighbouring leaves stay close
+void Surface::packTriangles(Arena& arena)
+{
+    // Count the blocks first so they can be written in place
+    this->numTriBlocks = 0;
+    for (int n = 0; n < this->numBVHNodes; n++)
+        this->numTriBlocks += (this->nodes[n].primCount + TRI_BLOCK_SIZE - 1) / TRI_BLOCK_SIZE;
+    this->triBlocks = arena.allocate<TriBlock>(this->numTriBlocks);
+
+    uint32_t numBlocks = 0;
+    for (int n = 0; n < this->numBVHNodes; n++) {
+        BVHNode& node = this->nodes[n];
+        if (node.primCount == 0) continue;
+
+        uint32_t firstBlock = numBlocks;
+        for (uint32_t i = 0; i < node.primCount; i += TRI_BLOCK_SIZE) {
+            TriBlock& block = this->triBlocks[numBlocks++];
+            block = TriBlock();
+            for (uint32_t lane = 0; lane < TRI_BLOCK_SIZE && i + lane < node.primCount; lane++) {
+                uint32_t triIdx = this->getIdx(node.firstPrim + i + lane);
+                const Tri& tri = this->tris[triIdx];
+                block.setTriangle(lane, this->vertices[tri.v[0]], this->vertices[tri.v[1]], this->vertices[tri.v[2]], triIdx);
+            }
+        }
+        node.firstPrim = firstBlock;
+    }
 }
 
 uint32_t Surface::getIdx(uint32_t idx)
@@ -296,107 +542,243 @@ void Surface::updateNodeBounds(uint32_t nodeIdx)
     BVHNode& node = this->nodes[nodeIdx];
 
     for (int i = 0; i < node.primCount; i++) {
-        auto triangle = this->tris[this->getIdx(i + node.firstPrim)];
-        node.bbox.min = Vector3f(
-            std::min(node.bbox.min.x, triangle.bbox.min.x),
-            std::min(node.bbox.min.y, triangle.bbox.min.y),
-            std::min(node.bbox.min.z, triangle.bbox.min.z)
-        );
-
-        node.bbox.max = Vector3f(
-            std::max(node.bbox.max.x, triangle.bbox.max.x),
-            std::max(node.bbox.max.y, triangle.bbox.max.y),
-            std::max(node.bbox.max.z, triangle.bbox.max.z)
-        );
-
-        node.bbox.centroid = (node.bbox.min + node.bbox.max) / 2.f;
+        node.bbox.grow(this->triBounds[this->getIdx(i + node.firstPrim)]);
     }
 }
 
+// Children go in implicit slots (see compactBVH), so subtrees never share a counter and can be
+// built on different threads; each one only touches its own slots and its own range of triIdxs
 void Surface::subdivideNode(uint32_t nodeIdx)
 {
     BVHNode& node = this->nodes[nodeIdx];
 
     if (node.primCount <= 1) return;
 
-    Vector3f extent = node.bbox.max - node.bbox.min;
-
-    int ax = 0;
-    if (extent.y > extent.x) ax = 1;
-    if (extent.z > extent[ax]) ax = 2;
-    float split = node.bbox.min[ax] + extent[ax] * 0.5f;
-
     int i = node.firstPrim;
     int j = i + node.primCount - 1;
 
-    while (i <= j) {
-        if (this->tris[this->getIdx(i)].centroid[ax] < split)
-            i++;
-        else {
-            auto temp = this->triIdxs[i];
-            this->triIdxs[i] = this->triIdxs[j];
-            this->triIdxs[j--] = temp;
+    // Child bounds come out of the split itself rather than another pass over the primitives
+    AABB leftBounds, rightBounds;
+    if (bvhSettings.builder == BVH_SAH) {
+        SAHSplit split = findSAHSplit(node,
+            [&](uint32_t k) -> const AABB& { return this->triBounds[this->getIdx(k)]; },
+            [&](uint32_t k) { return this->triCentroids[this->getIdx(k)]; }
+        );
+
+        // Keep the node as a leaf if splitting does not pay off (unless it holds too many primitives),
+        // or if all centroids coincide and there is nothing to split
+        float leafCost = bvhSettings.intersectionCost * node.primCount;
+        if (split.axis == -1) return;
+        if (split.cost >= leafCost && node.primCount <= bvhSettings.maxLeafSize) return;
+
+        while (i <= j) {
+            if (split.binOf(this->triCentroids[this->getIdx(i)]) < split.bin)
+                i++;
+            else {
+                auto temp = this->triIdxs[i];
+                this->triIdxs[i] = this->triIdxs[j];
+                this->triIdxs[j--] = temp;
+            }
+        }
+
+        leftBounds = split.leftBounds;
+        rightBounds = split.rightBounds;
+    }
+    else {
+        Vector3f extent = node.bbox.max - node.bbox.min;
+
+        int ax = 0;
+        if (extent.y > extent.x) ax = 1;
+        if (extent.z > extent[ax]) ax = 2;
+        float split = node.bbox.min[ax] + extent[ax] * 0.5f;
+
+        while (i <= j) {
+            uint32_t triIdx = this->getIdx(i);
+            if (this->triCentroids[triIdx][ax] < split) {
+                leftBounds.grow(this->triBounds[triIdx]);
+                i++;
+            }
+            else {
+                rightBounds.grow(this->triBounds[triIdx]);
+                auto temp = this->triIdxs[i];
+                this->triIdxs[i] = this->triIdxs[j];
+                this->triIdxs[j--] = temp;
+            }
         }
     }
 
     int leftCount = i - node.firstPrim;
     if (leftCount == 0 || leftCount == node.primCount) return;
 
-    uint32_t lidx = this->numBVHNodes++;
+    uint32_t lidx = nodeIdx + 1;
     BVHNode& left = this->nodes[lidx];
     left.firstPrim = node.firstPrim;
     left.primCount = leftCount;
-    this->updateNodeBounds(lidx);
+    left.bbox = leftBounds;
 
-    uint32_t ridx = this->numBVHNodes++;
+    uint32_t ridx = nodeIdx + 2 * leftCount;
     BVHNode& right = this->nodes[ridx];
     right.firstPrim = i;
     right.primCount = node.primCount - leftCount;
-    this->updateNodeBounds(ridx);
+    right.bbox = rightBounds;
 
+    int primCount = node.primCount;
     node.left = lidx;
     node.right = ridx;
     node.primCount = 0;
 
-    this->subdivideNode(lidx);
-    this->subdivideNode(ridx);
+    if (primCount >= PARALLEL_BUILD_THRESHOLD) {
+        int numThreads = bvhSettings.buildThreads > 0 ? bvhSettings.buildThreads : defaultThreadCount();
+        parallelInvoke(numThreads, [&]() { this->subdivideNode(lidx); }, [&]() { this->subdivideNode(ridx); });
+    }
+    else {
+        this->subdivideNode(lidx);
+        this->subdivideNode(ridx);
+    }
 }
 
-void Surface::intersectBVH(uint32_t nodeIdx, Ray& ray, Interaction& si)
+bool Surface::intersectLeaf(Ray& ray, uint32_t firstBlock, uint32_t primCount, HitRecord& hit)
 {
-    BVHNode& node = this->nodes[nodeIdx];
-
-    if (!node.bbox.intersects(ray)) return;
-
-    if (node.primCount != 0) {
-        // Leaf
-        for (uint32_t i = 0; i < node.primCount; i++) {
-            Interaction siIntermediate = this->rayTriangleIntersect(
-                ray,
-                this->tris[this->getIdx(i + node.firstPrim)].v1,
-                this->tris[this->getIdx(i + node.firstPrim)].v2,
-                this->tris[this->getIdx(i + node.firstPrim)].v3,
-                this->tris[this->getIdx(i + node.firstPrim)].normal
-            );
-            if (siIntermediate.t <= ray.t && siIntermediate.didIntersect) {
-
-                si = siIntermediate;
-                ray.t = si.t;
+    bool found = false;
+    float t[TRI_BLOCK_SIZE], b1[TRI_BLOCK_SIZE], b2[TRI_BLOCK_SIZE];
+    for (uint32_t b = 0; b * TRI_BLOCK_SIZE < primCount; b++) {
+        const TriBlock& block = this->triBlocks[firstBlock + b];
+        int mask = block.intersect(ray, t, b1, b2);
+
+        // Lanes in order, accepting ties, so the result matches testing the triangles one by one
+        for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+            if ((mask & 1) && t[lane] <= ray.t) {
+                hit.t = ray.t = t[lane];
+                hit.primIdx = block.triIdx[lane];
+                hit.b1 = b1[lane];
+                hit.b2 = b2[lane];
+                found = true;
             }
         }
     }
-    else {
-        this->intersectBVH(node.left, ray, si);
-        this->intersectBVH(node.right, ray, si);
-    }
+    return found;
 }
 
-Interaction Surface::rayIntersect(Ray& ray)
+void Surface::intersectBVH(Ray& ray, HitRecord& hit, TraversalStats* stats)
 {
-    Interaction si;
-    si.didIntersect = false;
+    auto leaf = [&](uint32_t firstBlock, uint32_t primCount) {
+        this->intersectLeaf(ray, firstBlock, primCount, hit);
+        return false;
+    };
+
+#if BVH_WIDTH > 2
+    traverseWideBVH(this->wideNodes, ray, leaf, stats);
+#else
+    traverseBVH(this->nodes, ray, leaf, stats);
+#endif
+}
+
+void Surface::intersectPacket(RayPacket& packet, int first, int last, uint32_t instanceIdx, TraversalStats* stats)
+{
+    auto leaf = [&](const PacketEntry& entry) {
+        for (int r = entry.first; r <= entry.last; r++) {
+            // Rays inside the range can still miss the leaf box, or have found something nearer since
+            Ray& ray = packet.rays[r];
+            if (entry.box.intersects(ray) == NO_INTERSECTION) continue;
+
+            if (this->intersectLeaf(ray, entry.idx, entry.primCount, packet.hits[r]))
+                packet.hits[r].instanceIdx = instanceIdx;
+        }
+    };
+
+#if BVH_WIDTH > 2
+    traversePacketBVH<BVH_WIDTH>(packet, first, last, [&](uint32_t idx, PacketEntry* children) {
+        return this->wideNodes[idx == PACKET_ROOT ? 0 : idx].expand(children);
+    }, leaf, stats);
+#else
+    traversePacketBVH<2>(packet, first, last, [&](uint32_t idx, PacketEntry* children) {
+        return expandBVHNode(this->nodes, idx, children);
+    }, leaf, stats);
+#endif
+}
+
+bool Surface::rayIntersect(Ray& ray, HitRecord& hit, TraversalStats* stats)
+{
+    HitRecord local;
 
-    this->intersectBVH(0, ray, si);
+    this->intersectBVH(ray, local, stats);
+    if (!local.didIntersect()) return false;
+
+    hit = local;
+    return true;
+}
+
+Interaction Surface::computeInteraction(const Ray& ray, const HitRecord& hit)
+{
+    Interaction si;
+    si.didIntersect = true;
+    si.intersected_on_surface = this;
+    si.primIdx = hit.primIdx;
+    si.b1 = hit.b1;
+    si.b2 = hit.b2;
+    si.t = hit.t;
+    si.p = ray.o + ray.d * hit.t;
+    const Tri& tri = this->tris[hit.primIdx];
+    si.n = Normalize(this->normals[tri.v[0]] + this->normals[tri.v[1]] + this->normals[tri.v[2]]);
 
     return si;
-}
\ No newline at end of file
+}
+
+// Intersects the neighbouring pixels' rays with the plane of the triangle and expresses the offsets of
+// those points from the hit in barycentrics, which carry over directly to the texture coordinates
+void Surface::computeDifferentials(const Ray& ray, const HitRecord& hit, Interaction& si)
+{
+    const Tri& tri = this->tris[hit.primIdx];
+    Vector3f v1 = this->vertices[tri.v[0]];
+    Vector3f e1 = this->vertices[tri.v[1]] - v1, e2 = this->vertices[tri.v[2]] - v1;
+    Vector3f n = Cross(e1, e2);
+
+    // Least-squares solve of offset = db1 * e1 + db2 * e2
+    float e11 = Dot(e1, e1), e12 = Dot(e1, e2), e22 = Dot(e2, e2);
+    float det = e11 * e22 - e12 * e12;
+    if (det == 0.f) return;
+
+    Vector3f p = ray.o + ray.d * hit.t;
+    float distance = Dot(n, p - ray.o);
+    Vector2f uv1 = this->uvs[tri.v[0]];
+    Vector2f du1 = this->uvs[tri.v[1]] - uv1, du2 = this->uvs[tri.v[2]] - uv1;
+
+    auto uvOffset = [&](Vector3f dD) {
+        Vector3f d = ray.d + dD;
+        float dDotN = Dot(d, n);
+        if (dDotN == 0.f) return Vector2f(0.f, 0.f);
+
+        Vector3f offset = ray.o + d * (distance / dDotN) - p;
+        float b1 = (e22 * Dot(offset, e1) - e12 * Dot(offset, e2)) / det;
+        float b2 = (e11 * Dot(offset, e2) - e12 * Dot(offset, e1)) / det;
+        return b1 * du1 + b2 * du2;
+    };
+    si.dUVdx = uvOffset(ray.dDdx);
+    si.dUVdy = uvOffset(ray.dDdy);
+}
+
+bool Surface::occluded(const Ray& ray, TraversalStats* stats)
+{
+    bool blocked = false;
+    float t[TRI_BLOCK_SIZE], b1[TRI_BLOCK_SIZE], b2[TRI_BLOCK_SIZE];
+    auto leaf = [&](uint32_t firstBlock, uint32_t primCount) {
+        for (uint32_t b = 0; b * TRI_BLOCK_SIZE < primCount && !blocked; b++) {
+            int mask = this->triBlocks[firstBlock + b].intersect(ray, t, b1, b2);
+            for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+                if ((mask & 1) && t[lane] < ray.t) {
+                    blocked = true;
+                    break;
+                }
+            }
+        }
+        return blocked;
+    };
+
+#if BVH_WIDTH > 2
+    traverseWideBVH(this->wideNodes, ray, leaf, stats);
+#else
+    traverseBVH(this->nodes, ray, leaf, stats);
+#endif
+
+    return blocked;
+}
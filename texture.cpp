@@ -1,4 +1,8 @@
 #include "texture.h"
+#include "texturecache.h"
+#include "parallel.h"
+
+#include <limits>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -10,38 +14,476 @@
 
 #define EPSILON 0.001
 
-Texture::Texture(std::string pathToImage)
+TextureLayout Texture::loadLayout = TEXTURE_LAYOUT_SCANLINE;
+TextureCompression Texture::loadCompression = TEXTURE_COMPRESSION_NONE;
+size_t Texture::tileBudget = 0;
+
+bool parseTextureLayout(std::string name, TextureLayout& layout)
+{
+    if (name == "scanline") layout = TEXTURE_LAYOUT_SCANLINE;
+    else if (name == "tiled4") layout = TEXTURE_LAYOUT_TILED_4;
+    else if (name == "tiled8") layout = TEXTURE_LAYOUT_TILED_8;
+    else if (name == "morton") layout = TEXTURE_LAYOUT_MORTON;
+    else return false;
+
+    return true;
+}
+
+std::string textureLayoutName(TextureLayout layout)
+{
+    switch (layout) {
+    case TEXTURE_LAYOUT_SCANLINE: return "scanline";
+    case TEXTURE_LAYOUT_TILED_4: return "tiled4";
+    case TEXTURE_LAYOUT_TILED_8: return "tiled8";
+    case TEXTURE_LAYOUT_MORTON: return "morton";
+    default: return "unknown";
+    }
+}
+
+bool parseTextureCompression(std::string name, TextureCompression& compression)
+{
+    if (name == "none") compression = TEXTURE_COMPRESSION_NONE;
+    else if (name == "bc1") compression = TEXTURE_COMPRESSION_BC1;
+    else return false;
+
+    return true;
+}
+
+std::string textureCompressionName(TextureCompression compression)
+{
+    switch (compression) {
+    case TEXTURE_COMPRESSION_NONE: return "none";
+    case TEXTURE_COMPRESSION_BC1: return "bc1";
+    default: return "unknown";
+    }
+}
+
+// 8-bit channel values as floats, so texel loads need no divides
+static const struct Unorm8Table {
+    float values[256];
+    Unorm8Table() { for (int i = 0; i < 256; i++) values[i] = i / 255.f; }
+} unorm8;
+
+// Moves the low 16 bits of 'v' to the even bit positions
+static uint32_t spreadBits(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+static int ceilLog2(int n)
+{
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    return bits;
+}
+
+Texture::Texture(std::string pathToImage, Arena& arena)
 {
     size_t pos = pathToImage.find(".exr");
 
+    // Textures stored compressed or in another layout are decoded and filtered in scanline order into
+    // scratch memory that is released once they are encoded or copied into 'arena'. Otherwise the
+    // decoder's output is kept as it is.
+    Arena scratch;
+    bool reencode = pos > pathToImage.length()
+        && (Texture::loadCompression != TEXTURE_COMPRESSION_NONE || Texture::loadLayout != TEXTURE_LAYOUT_SCANLINE);
+    Arena& target = reencode ? scratch : arena;
+
     if (pos > pathToImage.length()) {
         this->type = TextureType::UNSIGNED_INTEGER_ALPHA;
         pos = pathToImage.find(".png");
 
         if (pos > pathToImage.length()) 
-            this->loadJpg(pathToImage);
+            this->loadJpg(pathToImage, target);
         else
-            this->loadPng(pathToImage);
+            this->loadPng(pathToImage, target);
     }
     else {
         this->type = TextureType::FLOAT_ALPHA;
-        this->loadExr(pathToImage);
+        this->loadExr(pathToImage, target);
     }
+
+    this->generateMipmaps(target);
+    if (reencode && Texture::loadCompression != TEXTURE_COMPRESSION_NONE)
+        this->compress(Texture::loadCompression, arena);
+    else if (reencode)
+        this->relayout(Texture::loadLayout, arena);
 }
 
-void Texture::allocate(TextureType type, Vector2i resolution)
+size_t Texture::texelIndex(int x, int y, int level) const
 {
-    this->resolution = resolution;
-    this->type = type;
+    if (this->flipRows) y = this->levelResolution[level].y - 1 - y;
+
+    int pitch = this->levelPitch[level];
+    switch (this->layout) {
+    case TEXTURE_LAYOUT_TILED_4:
+        return (size_t((y >> 2) * pitch + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3);
+    case TEXTURE_LAYOUT_TILED_8:
+        return (size_t((y >> 3) * pitch + (x >> 3)) << 6) | ((y & 7) << 3) | (x & 7);
+    case TEXTURE_LAYOUT_MORTON: {
+        // Only the longer axis has bits above 'pitch'; they select a square block of the interleaved ones
+        uint32_t mask = (1u << pitch) - 1;
+        return (size_t((x | y) >> pitch) << (2 * pitch)) | spreadBits(x & mask) | (spreadBits(y & mask) << 1);
+    }
+    default:
+        return size_t(y) * pitch + x;
+    }
+}
 
-    if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA) {
-        uint32_t* dpointer = (uint32_t*) malloc(this->resolution.x * this->resolution.y * sizeof(uint32_t));
-        this->data = (uint64_t)dpointer;
+/*
+BC1 blocks are 64-bit words: the endpoint colors in the low and next 16 bits, then the 2-bit indices of
+the texels in row order. Blocks are stored in row order from the bottom left, and the blocks along the
+top and right edges are padded with copies of the edge texels. Only the four-color mode is used, and
+the decoder rounds the two colors in between exactly like the encoder.
+*/
+#define BC1_BLOCK_SIZE 4
+
+static void unpackRGB565(uint32_t color, int* rgb)
+{
+    int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+static uint32_t packRGB565(const float* rgb)
+{
+    int r = clamp(int(rgb[0] * 31.f / 255.f + 0.5f), 0, 31);
+    int g = clamp(int(rgb[1] * 63.f / 255.f + 0.5f), 0, 63);
+    int b = clamp(int(rgb[2] * 31.f / 255.f + 0.5f), 0, 31);
+    return (r << 11) | (g << 5) | b;
+}
+
+// Weight of the first endpoint, in thirds, for each index
+static const int bc1Weights[4] = {3, 0, 2, 1};
+
+static void bc1Palette(uint32_t color0, uint32_t color1, int palette[4][3])
+{
+    int a[3], b[3];
+    unpackRGB565(color0, a);
+    unpackRGB565(color1, b);
+    for (int i = 0; i < 4; i++)
+        for (int c = 0; c < 3; c++)
+            palette[i][c] = (bc1Weights[i] * a[c] + (3 - bc1Weights[i]) * b[c] + 1) / 3;
+}
+
+static uint32_t decodeBC1(uint64_t block, int x, int y)
+{
+    int a[3], b[3];
+    unpackRGB565(uint32_t(block) & 0xffff, a);
+    unpackRGB565(uint32_t(block >> 16) & 0xffff, b);
+    int w = bc1Weights[(block >> (32 + 2 * (y * BC1_BLOCK_SIZE + x))) & 3];
+
+    uint32_t texel = 255u << 24;
+    for (int c = 0; c < 3; c++)
+        texel |= uint32_t((w * a[c] + (3 - w) * b[c] + 1) / 3) << (8 * c);
+    return texel;
+}
+
+// Picks the closest palette color for every texel; returns the block and its squared error
+static uint64_t bc1Indices(const int colors[16][3], uint32_t color0, uint32_t color1, int* indices, int& error)
+{
+    int palette[4][3];
+    bc1Palette(color0, color1, palette);
+
+    error = 0;
+    uint64_t block = color0 | (color1 << 16);
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestError = INT32_MAX;
+        for (int p = 0; p < 4; p++) {
+            int dr = colors[i][0] - palette[p][0], dg = colors[i][1] - palette[p][1], db = colors[i][2] - palette[p][2];
+            int e = dr * dr + dg * dg + db * db;
+            if (e < bestError) {
+                best = p;
+                bestError = e;
+            }
+        }
+        indices[i] = best;
+        error += bestError;
+        block |= uint64_t(best) << (32 + 2 * i);
+    }
+    return block;
+}
+
+// Endpoints at the ends of the block's principal axis, refined by least squares on the chosen indices
+static uint64_t encodeBC1(const int colors[16][3])
+{
+    float mean[3] = {0.f, 0.f, 0.f};
+    for (int i = 0; i < 16; i++)
+        for (int c = 0; c < 3; c++)
+            mean[c] += colors[i][c] / 16.f;
+
+    float covariance[3][3] = {};
+    for (int i = 0; i < 16; i++)
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++)
+                covariance[j][k] += (colors[i][j] - mean[j]) * (colors[i][k] - mean[k]);
+
+    float axis[3] = {1.f, 1.f, 1.f};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[3];
+        for (int j = 0; j < 3; j++)
+            next[j] = covariance[j][0] * axis[0] + covariance[j][1] * axis[1] + covariance[j][2] * axis[2];
+        float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+        if (length == 0.f) break;
+        for (int j = 0; j < 3; j++)
+            axis[j] = next[j] / length;
+    }
+
+    float lo = 0.f, hi = 0.f;
+    for (int i = 0; i < 16; i++) {
+        float t = (colors[i][0] - mean[0]) * axis[0] + (colors[i][1] - mean[1]) * axis[1] + (colors[i][2] - mean[2]) * axis[2];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+    float end0[3], end1[3];
+    for (int c = 0; c < 3; c++) {
+        end0[c] = mean[c] + hi * axis[c];
+        end1[c] = mean[c] + lo * axis[c];
+    }
+
+    int indices[16], error;
+    uint32_t color0 = packRGB565(end0), color1 = packRGB565(end1);
+    uint64_t block = bc1Indices(colors, color0, color1, indices, error);
+
+    for (int iteration = 0; iteration < 2 && error > 0; iteration++) {
+        // Minimizes the error of every texel as w * end0 + (1 - w) * end1 with the weights of its index
+        float aa = 0.f, ab = 0.f, bb = 0.f, ax[3] = {}, bx[3] = {};
+        for (int i = 0; i < 16; i++) {
+            float w = bc1Weights[indices[i]] / 3.f;
+            aa += w * w;
+            ab += w * (1.f - w);
+            bb += (1.f - w) * (1.f - w);
+            for (int c = 0; c < 3; c++) {
+                ax[c] += w * colors[i][c];
+                bx[c] += (1.f - w) * colors[i][c];
+            }
+        }
+        float det = aa * bb - ab * ab;
+        if (std::abs(det) < 1e-6f) break;
+        for (int c = 0; c < 3; c++) {
+            end0[c] = (ax[c] * bb - bx[c] * ab) / det;
+            end1[c] = (bx[c] * aa - ax[c] * ab) / det;
+        }
+
+        int refinedIndices[16], refinedError;
+        uint32_t refined0 = packRGB565(end0), refined1 = packRGB565(end1);
+        uint64_t refined = bc1Indices(colors, refined0, refined1, refinedIndices, refinedError);
+        if (refinedError >= error) break;
+        block = refined;
+        error = refinedError;
+        color0 = refined0;
+        color1 = refined1;
+        std::copy(refinedIndices, refinedIndices + 16, indices);
+    }
+
+    // The four-color mode needs the first endpoint to be the larger one; equal endpoints only need index 0
+    if (color0 == color1)
+        return color0 | (color1 << 16);
+    if (color0 < color1) {
+        block = color1 | (color0 << 16);
+        for (int i = 0; i < 16; i++)
+            block |= uint64_t(indices[i] ^ 1) << (32 + 2 * i);
+    }
+    return block;
+}
+
+uint32_t Texture::texel(int x, int y, int level) const
+{
+    if (this->tiled)
+        return this->tiled->cache->texel(*this->tiled, x, y, level);
+    if (this->compression == TEXTURE_COMPRESSION_BC1) {
+        uint64_t block = ((const uint64_t*)this->levels[level])[(y / BC1_BLOCK_SIZE) * this->levelPitch[level] + x / BC1_BLOCK_SIZE];
+        return decodeBC1(block, x % BC1_BLOCK_SIZE, y % BC1_BLOCK_SIZE);
     }
-    else if (this->type == TextureType::FLOAT_ALPHA) {
-        float* dpointer = (float*)malloc(this->resolution.x * this->resolution.y * 4 * sizeof(float));
-        this->data = (uint64_t)dpointer;
+    return ((const uint32_t*)this->levels[level])[this->texelIndex(x, y, level)];
+}
+
+void Texture::compress(TextureCompression compression, Arena& arena)
+{
+    if (this->type != TextureType::UNSIGNED_INTEGER_ALPHA || compression == TEXTURE_COMPRESSION_NONE) return;
+
+    Texture source = *this;
+    double squaredError = 0.0;
+    for (int level = 0; level < this->numLevels; level++) {
+        Vector2i res = this->levelResolution[level];
+        int blocksX = (res.x + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE, blocksY = (res.y + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE;
+        uint64_t* blocks = arena.allocate<uint64_t>(size_t(blocksX) * blocksY);
+
+        for (int by = 0; by < blocksY; by++) {
+            for (int bx = 0; bx < blocksX; bx++) {
+                int colors[16][3];
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(bx * BC1_BLOCK_SIZE + i % BC1_BLOCK_SIZE, res.x - 1);
+                    int y = std::min(by * BC1_BLOCK_SIZE + i / BC1_BLOCK_SIZE, res.y - 1);
+                    uint32_t texel = source.texel(x, y, level);
+                    for (int c = 0; c < 3; c++)
+                        colors[i][c] = (texel >> (8 * c)) & 255u;
+                }
+                uint64_t block = encodeBC1(colors);
+                blocks[size_t(by) * blocksX + bx] = block;
+
+                if (level != 0) continue;
+                for (int i = 0; i < 16; i++) {
+                    int x = bx * BC1_BLOCK_SIZE + i % BC1_BLOCK_SIZE, y = by * BC1_BLOCK_SIZE + i / BC1_BLOCK_SIZE;
+                    if (x >= res.x || y >= res.y) continue;
+                    uint32_t decoded = decodeBC1(block, i % BC1_BLOCK_SIZE, i / BC1_BLOCK_SIZE);
+                    for (int c = 0; c < 3; c++) {
+                        int d = colors[i][c] - int((decoded >> (8 * c)) & 255u);
+                        squaredError += d * d;
+                    }
+                }
+            }
+        }
+
+        this->levels[level] = blocks;
+        this->levelPitch[level] = blocksX;
     }
+
+    this->data = this->levels[0];
+    this->compression = compression;
+    this->layout = TEXTURE_LAYOUT_SCANLINE;
+    this->flipRows = false;
+
+    double meanSquaredError = squaredError / (3.0 * this->resolution.x * this->resolution.y);
+    this->compressionPSNR = meanSquaredError > 0.0 ? float(10.0 * std::log10(255.0 * 255.0 / meanSquaredError))
+        : std::numeric_limits<float>::infinity();
+}
+
+size_t Texture::levelTexels(int level) const
+{
+    Vector2i res = this->levelResolution[level];
+    switch (this->layout) {
+    case TEXTURE_LAYOUT_TILED_4:
+        return size_t(this->levelPitch[level]) * ((res.y + 3) / 4) * 16;
+    case TEXTURE_LAYOUT_TILED_8:
+        return size_t(this->levelPitch[level]) * ((res.y + 7) / 8) * 64;
+    case TEXTURE_LAYOUT_MORTON:
+        return size_t(1) << (ceilLog2(res.x) + ceilLog2(res.y));
+    default:
+        return size_t(res.x) * res.y;
+    }
+}
+
+size_t Texture::memoryUsed() const
+{
+    if (!this->data) return 0;
+    if (this->type == TextureType::FLOAT_ALPHA)
+        return size_t(this->resolution.x) * this->resolution.y * 4 * sizeof(float);
+
+    size_t texels = 0, blocks = 0;
+    for (int level = 0; level < this->numLevels; level++) {
+        Vector2i res = this->levelResolution[level];
+        if (this->compression == TEXTURE_COMPRESSION_BC1)
+            blocks += size_t((res.x + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE) * ((res.y + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE);
+        else
+            texels += this->levelTexels(level);
+    }
+    return texels * sizeof(uint32_t) + blocks * sizeof(uint64_t);
+}
+
+void Texture::relayout(TextureLayout layout, Arena& arena)
+{
+    if (this->type != TextureType::UNSIGNED_INTEGER_ALPHA || this->compression != TEXTURE_COMPRESSION_NONE) return;
+
+    Texture source = *this;
+    this->layout = layout;
+    this->flipRows = false;
+    for (int level = 0; level < this->numLevels; level++) {
+        Vector2i res = this->levelResolution[level];
+
+        // Partial tiles and the Morton order's power-of-two extents are padded; the padding is never read
+        if (layout == TEXTURE_LAYOUT_TILED_4 || layout == TEXTURE_LAYOUT_TILED_8) {
+            int tile = layout == TEXTURE_LAYOUT_TILED_4 ? 4 : 8;
+            this->levelPitch[level] = (res.x + tile - 1) / tile;
+        }
+        else if (layout == TEXTURE_LAYOUT_MORTON)
+            this->levelPitch[level] = std::min(ceilLog2(res.x), ceilLog2(res.y));
+        else
+            this->levelPitch[level] = res.x;
+
+        const uint32_t* src = (const uint32_t*)source.levels[level];
+        uint32_t* texels = arena.allocate<uint32_t>(this->levelTexels(level));
+        for (int y = 0; y < res.y; y++)
+            for (int x = 0; x < res.x; x++)
+                texels[this->texelIndex(x, y, level)] = src[source.texelIndex(x, y, level)];
+        arena.countCopy(size_t(res.x) * res.y * sizeof(uint32_t));
+
+        this->levels[level] = texels;
+    }
+    this->data = this->levels[0];
+}
+
+// Expects the texture in scanline order, as it comes out of the loaders; the levels keep its row order
+void Texture::generateMipmaps(Arena& arena)
+{
+    this->numLevels = 1;
+    this->levels[0] = this->data;
+    this->levelResolution[0] = this->resolution;
+    this->levelPitch[0] = this->resolution.x;
+    if (this->type != TextureType::UNSIGNED_INTEGER_ALPHA) return;
+
+    while (this->numLevels < MAX_MIP_LEVELS) {
+        int above = this->numLevels - 1, current = this->numLevels;
+        Vector2i src = this->levelResolution[above];
+        if (src.x == 1 && src.y == 1) break;
+
+        // Odd sizes round down, and the last texel on such an axis averages the last three of the level
+        // above instead of two, so every level covers all of the one above
+        Vector2i dst(std::max(1, src.x / 2), std::max(1, src.y / 2));
+        const uint32_t* texelsAbove = (const uint32_t*)this->levels[above];
+        uint32_t* texels = arena.allocate<uint32_t>(size_t(dst.x) * dst.y);
+        this->levels[current] = texels;
+        this->levelResolution[current] = dst;
+        this->levelPitch[current] = dst.x;
+
+        for (int y = 0; y < dst.y; y++) {
+            int y0 = 2 * y, y1 = y == dst.y - 1 ? src.y - 1 : 2 * y + 1;
+            for (int x = 0; x < dst.x; x++) {
+                int x0 = 2 * x, x1 = x == dst.x - 1 ? src.x - 1 : 2 * x + 1;
+                uint32_t count = uint32_t((x1 - x0 + 1) * (y1 - y0 + 1));
+
+                uint32_t sum[4] = {0, 0, 0, 0};
+                for (int sy = y0; sy <= y1; sy++) {
+                    for (int sx = x0; sx <= x1; sx++) {
+                        uint32_t t = texelsAbove[this->texelIndex(sx, sy, above)];
+                        for (int c = 0; c < 4; c++)
+                            sum[c] += (t >> (8 * c)) & 255u;
+                    }
+                }
+
+                uint32_t texel = 0;
+                for (int c = 0; c < 4; c++)
+                    texel |= ((sum[c] + count / 2) / count) << (8 * c);
+                texels[this->texelIndex(x, y, current)] = texel;
+            }
+        }
+
+        this->numLevels++;
+    }
+}
+
+void Texture::allocate(TextureType type, Vector2i resolution, Arena& arena)
+{
+    this->resolution = resolution;
+    this->type = type;
+
+    if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA)
+        this->data = arena.allocate<uint32_t>(size_t(this->resolution.x) * this->resolution.y);
+    else if (this->type == TextureType::FLOAT_ALPHA)
+        this->data = arena.allocate<float>(size_t(this->resolution.x) * this->resolution.y * 4);
+
+    this->layout = TEXTURE_LAYOUT_SCANLINE;
+    this->flipRows = false;
+    this->numLevels = 1;
+    this->levels[0] = this->data;
+    this->levelResolution[0] = this->resolution;
+    this->levelPitch[0] = this->resolution.x;
 }
 
 void Texture::writePixelColor(Vector3f color, int x, int y)
@@ -56,7 +498,7 @@ void Texture::writePixelColor(Vector3f color, int x, int y)
 
         uint32_t final = r | g | b | a;
 
-        dpointer[y * this->resolution.x + x] = final;
+        dpointer[this->texelIndex(x, y, 0)] = final;
     }
 }
 
@@ -65,43 +507,40 @@ Reads the color defined at integer coordinates 'x,y'.
 The top left corner of the texture is mapped to '0,0'.
 */
 Vector3f Texture::loadPixelColor(int x, int y) {
+    return this->loadPixelColor(x, y, 0);
+}
+
+// Coordinates outside the level are clamped to its edge; bilinearFetch asks for one texel past the
+// last row or column, with zero weight, at u or v = 1
+Vector3f Texture::loadPixelColor(int x, int y, int level)
+{
     Vector3f rval(0.f, 0.f, 0.f);
     if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA) {
-        uint32_t* dpointer = (uint32_t*)this->data;
+        x = clamp(x, 0, this->levelResolution[level].x - 1);
+        y = clamp(y, 0, this->levelResolution[level].y - 1);
 
-        uint32_t val = dpointer[y * this->resolution.x + x];
-        uint32_t r = (val >> 0) & 255u;
-        uint32_t g = (val >> 8) & 255u;
-        uint32_t b = (val >> 16) & 255u;
-
-        rval.x = r / 255.f;
-        rval.y = g / 255.f;
-        rval.z = b / 255.f;
+        uint32_t val = this->texel(x, y, level);
+        rval.x = unorm8.values[(val >> 0) & 255u];
+        rval.y = unorm8.values[(val >> 8) & 255u];
+        rval.z = unorm8.values[(val >> 16) & 255u];
     }
 
     return rval;
 }
 
-void Texture::loadJpg(std::string pathToJpg)
+void Texture::loadJpg(std::string pathToJpg, Arena& arena)
 {
     Vector2i res;
     int comp;
     unsigned char* image = stbi_load(pathToJpg.c_str(), &res.x, &res.y, &comp, STBI_rgb_alpha);
     int textureID = -1;
     if (image) {
-        this->resolution = res;
-        this->data = (uint64_t)image;
-
         /* iw - actually, it seems that stbi loads the pictures
-            mirrored along the y axis - mirror them here */
-        for (int y = 0; y < res.y / 2; y++) {
-            uint32_t* line_y = (uint32_t*)this->data + y * res.x;
-            uint32_t* mirrored_y = (uint32_t*)this->data + (res.y - 1 - y) * res.x;
-            int mirror_y = res.y - 1 - y;
-            for (int x = 0; x < res.x; x++) {
-                std::swap(line_y[x], mirrored_y[x]);
-            }
-        }
+            mirrored along the y axis - the rows are read bottom up instead, see texelIndex */
+        this->resolution = res;
+        this->data = image;
+        this->flipRows = true;
+        arena.adopt(image, size_t(res.x) * res.y * sizeof(uint32_t));
     }
     else {
         std::cerr << "Could not load .jpg texture from " << pathToJpg << std::endl;
@@ -110,26 +549,19 @@ void Texture::loadJpg(std::string pathToJpg)
     }
 }
 
-void Texture::loadPng(std::string pathToPng)
+void Texture::loadPng(std::string pathToPng, Arena& arena)
 {
     Vector2i res;
     int comp;
     unsigned char* image = stbi_load(pathToPng.c_str(), &res.x, &res.y, &comp, STBI_rgb_alpha);
     int textureID = -1;
     if (image) {
-        this->resolution = res;
-        this->data = (uint64_t)image;
-
         /* iw - actually, it seems that stbi loads the pictures
-            mirrored along the y axis - mirror them here */
-        for (int y = 0; y < res.y / 2; y++) {
-            uint32_t* line_y = (uint32_t*)this->data + y * res.x;
-            uint32_t* mirrored_y = (uint32_t*)this->data + (res.y - 1 - y) * res.x;
-            int mirror_y = res.y - 1 - y;
-            for (int x = 0; x < res.x; x++) {
-                std::swap(line_y[x], mirrored_y[x]);
-            }
-        }
+            mirrored along the y axis - the rows are read bottom up instead, see texelIndex */
+        this->resolution = res;
+        this->data = image;
+        this->flipRows = true;
+        arena.adopt(image, size_t(res.x) * res.y * sizeof(uint32_t));
     }
     else {
         std::cerr << "Could not load .png texture from " << pathToPng << std::endl;
@@ -138,7 +570,7 @@ void Texture::loadPng(std::string pathToPng)
     }
 }
 
-void Texture::loadExr(std::string pathToExr)
+void Texture::loadExr(std::string pathToExr, Arena& arena)
 {
     int width;
     int height;
@@ -146,7 +578,6 @@ void Texture::loadExr(std::string pathToExr)
     
     float* data;
     int ret = LoadEXR(&data, &width, &height, pathToExr.c_str(), &err);
-    this->data = (uint64_t)data;
 
     if (ret != TINYEXR_SUCCESS) {
         std::cerr << "Could not load .exr texture map from " << pathToExr << std::endl;
@@ -154,6 +585,8 @@ void Texture::loadExr(std::string pathToExr)
     }
     else {
         this->resolution = Vector2i(width, height);
+        this->data = data;
+        arena.adopt(data, size_t(width) * height * 4 * sizeof(float));
     }
 }
 
@@ -172,10 +605,8 @@ void Texture::save(std::string path)
 void Texture::saveExr(std::string path)
 {
     if (this->type == TextureType::FLOAT_ALPHA) {
-        uint64_t hostData = this->data;
-
         const char* err = nullptr;
-        SaveEXR((float*)hostData, this->resolution.x, this->resolution.y, 4, 0, path.c_str(), &err);
+        SaveEXR((float*)this->data, this->resolution.x, this->resolution.y, 4, 0, path.c_str(), &err);
         
         if (err == nullptr)
             std::cout << "Saved EXR: " << path << std::endl;
@@ -190,8 +621,7 @@ void Texture::saveExr(std::string path)
 void Texture::savePng(std::string path) 
 {
     if (this->type == TextureType::UNSIGNED_INTEGER_ALPHA) {
-        uint64_t hostData = this->data;
-        const uint32_t* data = (const uint32_t*)hostData;
+        const uint32_t* data = (const uint32_t*)this->data;
 
         std::vector<uint32_t> pixels;
         for (int y = 0; y < this->resolution.y; y++) {
@@ -210,67 +640,99 @@ void Texture::savePng(std::string path)
     }
 }
 
-double computeArea(Vector3f v1, Vector3f v2, Vector3f v3){
-    Vector3f side1 = (v2 - v3);
-    Vector3f side2 = (v3 - v1);
-    Vector3f side3 = (v1 - v2);
-    
-    // double s = (side1.Length() + side2.Length() + side3.Length()) / 2;
+void TextureRegistry::request(const std::string& path, Arena& arena)
+{
+    auto it = this->index.find(path);
+    if (it != this->index.end()) {
+        this->entries[it->second].references++;
+        return;
+    }
 
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->index[path] = this->entries.size();
+    this->entries.push_back({path, Texture(), 1, &arena});
 
+    // Workers exit once they find nothing pending, so start one whenever the thread budget shared with
+    // the BVH builds has room; the loading thread joins in from wait()
+    int numThreads = this->numThreads > 0 ? this->numThreads : defaultThreadCount();
+    if (this->activeWorkers < numThreads - 1 && reserveThreads(1, numThreads) == 1) {
+        this->activeWorkers++;
+        this->workers.emplace_back(&TextureRegistry::decodeLoop, this);
+    }
+}
 
-    // double area = std::sqrt(std::abs(s * (s - side1.Length()) * (s - side2.Length()) * (s - side3.Length())));
+void TextureRegistry::decodeLoop()
+{
+    this->decodePending();
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->activeWorkers--;
+    releaseThreads(1);
+}
 
-    float area = Cross(side1, side2).Length() / 2;
+void TextureRegistry::decodePending()
+{
+    while (true) {
+        Entry* entry;
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (this->nextPending == this->entries.size()) return;
+            entry = &this->entries[this->nextPending++];
+        }
+        // EXR images stay in memory; so does any image the tile cache cannot take
+        bool isExr = entry->path.find(".exr") != std::string::npos;
+        if (!this->tileCache || isExr || !this->tileCache->open(entry->path, entry->texture))
+            entry->texture = Texture(entry->path, *entry->arena);
+    }
+}
 
+void TextureRegistry::wait()
+{
+    this->decodePending();
+    for (auto& worker : this->workers)
+        worker.join();
+    this->workers.clear();
+}
 
-    return area;
+Texture TextureRegistry::get(const std::string& path) const
+{
+    return this->entries[this->index.at(path)].texture;
 }
 
-// Get UV Coordinates at intersection point using barycentric coordinates
-Vector2f Texture::getUVCoordinates(Vector3f intersection_point, Vector3f v1, Vector3f v2, Vector3f v3, Vector2f u1, Vector2f u2, Vector2f u3){
-    float main_triangle_area = computeArea(v1, v2, v3);
-    if(main_triangle_area <= 0){
-        std::cout << "SQRT of Negative quantity" << std::endl;
+void TextureRegistry::report() const
+{
+    if (this->entries.empty()) return;
+
+    size_t total = 0;
+    int references = 0;
+    for (auto& entry : this->entries) {
+        total += entry.texture.memoryUsed();
+        references += entry.references;
     }
-    float alpha    = computeArea(intersection_point, v2, v3) / main_triangle_area;
-    float beta     = computeArea(v1, intersection_point, v3) / main_triangle_area;
-    float gamma    = computeArea(v1, v2, intersection_point) / main_triangle_area;
 
-    // if(std::isnan(alpha)){
-    //     alpha = 0;
-    // }
-    // if(std::isnan(beta)){
-    //     beta = 0;
-    // }
-    // if(std::isnan(gamma)){
-    //     gamma = 0;
-    // }
+    std::cout << "Textures: " << this->entries.size() << " decoded for " << references << " references, "
+        << total / (1024.f * 1024.f) << " MB" << std::endl;
+    for (auto& entry : this->entries) {
+        std::cout << "  " << entry.path << ": " << entry.texture.resolution.x << "x" << entry.texture.resolution.y << ", ";
+        if (entry.texture.tiled) std::cout << "out of core, ";
+        else std::cout << entry.texture.memoryUsed() / (1024.f * 1024.f) << " MB, ";
+        if (entry.texture.compression != TEXTURE_COMPRESSION_NONE)
+            std::cout << textureCompressionName(entry.texture.compression) << " at " << entry.texture.compressionPSNR << " dB PSNR, ";
+        std::cout << entry.references
+            << (entry.references == 1 ? " surface" : " surfaces") << std::endl;
+    }
+}
+
+// Get UV Coordinates at intersection point using the barycentric coordinates found by the intersector
+Vector2f Texture::getUVCoordinates(float b1, float b2, Vector2f u1, Vector2f u2, Vector2f u3){
+    float b0 = 1.f - b1 - b2;
 
-    // Assuming u1, u2, u3 are defined and you want to print their values as well
     #ifdef DEBUG 
-    std::cout << "IP: " << "x: " << intersection_point.x << ", y: " << intersection_point.y << ", z: " << intersection_point.z << std::endl; 
-
-
-    std::cout << "v1: " << "x: " << v1.x << ", y: " << v1.y << ", z: " << v1.z << std::endl; 
-    std::cout << "v2: " << "x: " << v2.x << ", y: " << v2.y << ", z: " << v2.z << std::endl;
-    std::cout << "v3: " << "x: " << v3.x << ", y: " << v3.y << ", z: " << v3.z << std::endl;
-    // Assuming u1, u2, u3 are defined and you want to print their values as well
-    std::cout << "v1: " << "Length: " << (v1 - v2).Length() << std::endl;
-    std::cout << "v2: " << "Length: " << (v2 - v3).Length() << std::endl;
-    std::cout << "v3: " << "Length: " << (v3 - v1).Length() << std::endl;
-    // Printing the values
-    std::cout << "Main Triangle Area: " << main_triangle_area << std::endl;
-    std::cout << "Alpha: " << alpha << std::endl;
-    std::cout << "Beta: " << beta << std::endl;
-    std::cout << "Gamma: " << gamma << std::endl;
-
-    // Assuming u1, u2, u3 are defined and you want to print their values as well
+    std::cout << "Barycentrics: " << b0 << ", " << b1 << ", " << b2 << std::endl;
     std::cout << "u1: " << "x: " << u1.x << ", y: " << u1.y << std::endl;
     std::cout << "u2: " << "x: " << u2.x << ", y: " << u2.y << std::endl;
     std::cout << "u3: " << "x: " << u3.x << ", y: " << u3.y << std::endl;
     #endif
-    Vector2f uv = alpha * u1 + beta * u2 + gamma * u3;
+    Vector2f uv = b0 * u1 + b1 * u2 + b2 * u3;
 
     // uv.x = clamp(uv.x, 0.0f, 1.0f);
     // uv.y = clamp(uv.y, 0.0f, 1.0f);
@@ -340,11 +802,7 @@ Vector3f Texture::nearestNeighbourFetch(float u, float v, int x, int y){
         min_distance = (middle_vector - bottomCornerRight).Length();
     }
     
-    std::vector<Vector2f> corners;
-    corners.push_back(topCornerLeft);
-    corners.push_back(topCornerRight);
-    corners.push_back(bottomCornerLeft);
-    corners.push_back(bottomCornerRight);
+    Vector2f corners[4] = {topCornerLeft, topCornerRight, bottomCornerLeft, bottomCornerRight};
 
     // if(x == 1000 && y == 1000){
     //     for(int i = 0; i < corners.size(); i++){
@@ -352,9 +810,6 @@ Vector3f Texture::nearestNeighbourFetch(float u, float v, int x, int y){
     //     }
     // }    
 
-    std::vector<Vector3f> colors;
-    for(int i = 0; i < corners.size(); i++)
-    colors.push_back(this->loadPixelColor(corners[i].x, corners[i].y));
 
     color = this->loadPixelColor((int)pass_wala_padosi.x, (int)pass_wala_padosi.y);
     // if(x == 700 && y == 700){
@@ -379,8 +834,10 @@ Vector3f Texture::nearestNeighbourFetch(float u, float v, int x, int y){
 
     if(x == 900 && y == 750){
         std::cout << "Printing this information" << std::endl;
-        for(int i = 0; i < colors.size(); i++)
-        std::cout << colors[i].x << ", " << colors[i].y << ", " << colors[i].z << std::endl;
+        for(int i = 0; i < 4; i++){
+            Vector3f corner = this->loadPixelColor(corners[i].x, corners[i].y);
+            std::cout << corner.x << ", " << corner.y << ", " << corner.z << std::endl;
+        }
 
         std::cout << color.x << ", " << color.y << ", " << color.z << std::endl;
     }
@@ -411,18 +868,10 @@ Vector3f Texture::bilinearFetch(float u, float v, int x, int y){
 
     float min_distance = 1e30;
 
-    std::vector<Vector2f> corners;
-    corners.push_back(topCornerLeft);
-    corners.push_back(topCornerRight);
-    corners.push_back(bottomCornerLeft);
-    corners.push_back(bottomCornerRight);
+    Vector2f corners[4] = {topCornerLeft, topCornerRight, bottomCornerLeft, bottomCornerRight};
 
     Vector3f cu, cl;
 
-    std::vector<Vector3f> colors;
-    for(int i = 0; i < corners.size(); i++)
-    colors.push_back(this->loadPixelColor(corners[i].x, corners[i].y));
-
     cu = (topCornerRight.x - middle_vector.x) * this->loadPixelColor(topCornerLeft.x, topCornerLeft.y)
         +
          (middle_vector.x - topCornerLeft.x) * this->loadPixelColor(topCornerRight.x, topCornerRight.y);
@@ -438,11 +887,249 @@ Vector3f Texture::bilinearFetch(float u, float v, int x, int y){
         std::cout << cl.x << ", " << cl.y << ", " << cl.z << std::endl;
 
         std::cout << "Printing this information" << std::endl;
-        for(int i = 0; i < colors.size(); i++)
-        std::cout << colors[i].x << ", " << colors[i].y << ", " << colors[i].z << std::endl;
+        for(int i = 0; i < 4; i++){
+            Vector3f corner = this->loadPixelColor(corners[i].x, corners[i].y);
+            std::cout << corner.x << ", " << corner.y << ", " << corner.z << std::endl;
+        }
 
         std::cout << color.x << ", " << color.y << ", " << color.z << std::endl;
     }
 
     return color;
-}
\ No newline at end of file
+}
+
+// Level 0 texels at the integer coordinates of every lane, clamped to the texture like loadPixelColor
+static void gatherTexels(const Texture& texture, const int* x, const int* y, uint32_t* texels)
+{
+    for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+        int cx = clamp(x[lane], 0, texture.resolution.x - 1), cy = clamp(y[lane], 0, texture.resolution.y - 1);
+        texels[lane] = texture.texel(cx, cy, 0);
+    }
+}
+
+static void clearBatch(TextureBatch& batch)
+{
+    for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++)
+        batch.r[lane] = batch.g[lane] = batch.b[lane] = 0.f;
+}
+
+/*
+The batched fetches follow the float arithmetic of the single ones step by step, so the two agree to the
+bit (in FMA builds the compiler may fuse multiply-adds of the single fetches, which can tip a rounding
+tie the other way). Corner coordinates are clamped before they are truncated, which gives the same integers as flooring
+first. Channels are converted in registers; dividing by 255 there is exact, like the lookup table.
+*/
+void Texture::nearestNeighbourFetch(TextureBatch& batch)
+{
+    if (this->type != TextureType::UNSIGNED_INTEGER_ALPHA) {
+        clearBatch(batch);
+        return;
+    }
+
+    int x[TEXTURE_BATCH_SIZE], y[TEXTURE_BATCH_SIZE];
+    uint32_t texels[TEXTURE_BATCH_SIZE];
+#if defined(__AVX2__)
+    __m256 u = _mm256_loadu_ps(batch.u), v = _mm256_loadu_ps(batch.v), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    __m256 left = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(
+        _mm256_mul_ps(u, _mm256_set1_ps(float(this->resolution.x - 1))), zero), _mm256_set1_ps(float(this->resolution.x - 2)))));
+    __m256 top = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(
+        _mm256_mul_ps(v, _mm256_set1_ps(float(this->resolution.y - 1))), zero), _mm256_set1_ps(float(this->resolution.y - 2)))));
+    __m256 right = _mm256_add_ps(left, one), bottom = _mm256_add_ps(top, one);
+    __m256 mx = _mm256_mul_ps(u, _mm256_set1_ps(float(this->resolution.x - 2)));
+    __m256 my = _mm256_mul_ps(v, _mm256_set1_ps(float(this->resolution.y - 2)));
+
+    auto distance = [&](__m256 cx, __m256 cy) {
+        __m256 dx = _mm256_sub_ps(mx, cx), dy = _mm256_sub_ps(my, cy);
+        return _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+    };
+
+    // Corners in the order of the single fetch; a later one wins only if strictly closer
+    __m256 best = distance(left, top), sx = left, sy = top;
+    auto consider = [&](__m256 cx, __m256 cy) {
+        __m256 d = distance(cx, cy);
+        __m256 closer = _mm256_cmp_ps(d, best, _CMP_LT_OQ);
+        best = _mm256_blendv_ps(best, d, closer);
+        sx = _mm256_blendv_ps(sx, cx, closer);
+        sy = _mm256_blendv_ps(sy, cy, closer);
+    };
+    consider(right, top);
+    consider(left, bottom);
+    consider(right, bottom);
+
+    _mm256_storeu_si256((__m256i*)x, _mm256_cvttps_epi32(sx));
+    _mm256_storeu_si256((__m256i*)y, _mm256_cvttps_epi32(sy));
+    gatherTexels(*this, x, y, texels);
+
+    __m256i t = _mm256_loadu_si256((const __m256i*)texels), mask = _mm256_set1_epi32(255);
+    __m256 scale = _mm256_set1_ps(255.f);
+    _mm256_storeu_ps(batch.r, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(t, mask)), scale));
+    _mm256_storeu_ps(batch.g, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(t, 8), mask)), scale));
+    _mm256_storeu_ps(batch.b, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(t, 16), mask)), scale));
+#elif defined(USE_SSE)
+    __m128 u = _mm_loadu_ps(batch.u), v = _mm_loadu_ps(batch.v), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 left = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(
+        _mm_mul_ps(u, _mm_set1_ps(float(this->resolution.x - 1))), zero), _mm_set1_ps(float(this->resolution.x - 2)))));
+    __m128 top = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(
+        _mm_mul_ps(v, _mm_set1_ps(float(this->resolution.y - 1))), zero), _mm_set1_ps(float(this->resolution.y - 2)))));
+    __m128 right = _mm_add_ps(left, one), bottom = _mm_add_ps(top, one);
+    __m128 mx = _mm_mul_ps(u, _mm_set1_ps(float(this->resolution.x - 2)));
+    __m128 my = _mm_mul_ps(v, _mm_set1_ps(float(this->resolution.y - 2)));
+
+    auto distance = [&](__m128 cx, __m128 cy) {
+        __m128 dx = _mm_sub_ps(mx, cx), dy = _mm_sub_ps(my, cy);
+        return _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+    };
+    auto select = [](__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+
+    // Corners in the order of the single fetch; a later one wins only if strictly closer
+    __m128 best = distance(left, top), sx = left, sy = top;
+    auto consider = [&](__m128 cx, __m128 cy) {
+        __m128 d = distance(cx, cy);
+        __m128 closer = _mm_cmplt_ps(d, best);
+        best = select(closer, d, best);
+        sx = select(closer, cx, sx);
+        sy = select(closer, cy, sy);
+    };
+    consider(right, top);
+    consider(left, bottom);
+    consider(right, bottom);
+
+    _mm_storeu_si128((__m128i*)x, _mm_cvttps_epi32(sx));
+    _mm_storeu_si128((__m128i*)y, _mm_cvttps_epi32(sy));
+    gatherTexels(*this, x, y, texels);
+
+    __m128i t = _mm_loadu_si128((const __m128i*)texels), mask = _mm_set1_epi32(255);
+    __m128 scale = _mm_set1_ps(255.f);
+    _mm_storeu_ps(batch.r, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(t, mask)), scale));
+    _mm_storeu_ps(batch.g, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(t, 8), mask)), scale));
+    _mm_storeu_ps(batch.b, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(t, 16), mask)), scale));
+#else
+    for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+        Vector3f color = this->nearestNeighbourFetch(batch.u[lane], batch.v[lane], -1, -1);
+        batch.r[lane] = color.x;
+        batch.g[lane] = color.y;
+        batch.b[lane] = color.z;
+    }
+#endif
+}
+
+void Texture::bilinearFetch(TextureBatch& batch)
+{
+    if (this->type != TextureType::UNSIGNED_INTEGER_ALPHA) {
+        clearBatch(batch);
+        return;
+    }
+
+    int x0[TEXTURE_BATCH_SIZE], y0[TEXTURE_BATCH_SIZE], x1[TEXTURE_BATCH_SIZE], y1[TEXTURE_BATCH_SIZE];
+    uint32_t t00[TEXTURE_BATCH_SIZE], t10[TEXTURE_BATCH_SIZE], t01[TEXTURE_BATCH_SIZE], t11[TEXTURE_BATCH_SIZE];
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    __m256 mx = _mm256_mul_ps(_mm256_loadu_ps(batch.u), _mm256_set1_ps(float(this->resolution.x - 1)));
+    __m256 my = _mm256_mul_ps(_mm256_loadu_ps(batch.v), _mm256_set1_ps(float(this->resolution.y - 1)));
+    __m256i xi = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(mx, zero), _mm256_set1_ps(float(this->resolution.x) - 1)));
+    __m256i yi = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(my, zero), _mm256_set1_ps(float(this->resolution.y) - 1)));
+
+    _mm256_storeu_si256((__m256i*)x0, xi);
+    _mm256_storeu_si256((__m256i*)y0, yi);
+    _mm256_storeu_si256((__m256i*)x1, _mm256_add_epi32(xi, _mm256_set1_epi32(1)));
+    _mm256_storeu_si256((__m256i*)y1, _mm256_add_epi32(yi, _mm256_set1_epi32(1)));
+    gatherTexels(*this, x0, y0, t00);
+    gatherTexels(*this, x1, y0, t10);
+    gatherTexels(*this, x0, y1, t01);
+    gatherTexels(*this, x1, y1, t11);
+
+    __m256 left = _mm256_cvtepi32_ps(xi), top = _mm256_cvtepi32_ps(yi);
+    __m256 wLeft = _mm256_sub_ps(_mm256_add_ps(left, one), mx), wRight = _mm256_sub_ps(mx, left);
+    __m256 wTop = _mm256_sub_ps(_mm256_add_ps(top, one), my), wBottom = _mm256_sub_ps(my, top);
+
+    __m256i mask = _mm256_set1_epi32(255);
+    __m256 scale = _mm256_set1_ps(255.f);
+    auto channel = [&](const uint32_t* texels, int shift) {
+        __m256i t = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i*)texels), shift);
+        return _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(t, mask)), scale);
+    };
+    auto filter = [&](int shift) {
+        __m256 upper = _mm256_add_ps(_mm256_mul_ps(wLeft, channel(t00, shift)), _mm256_mul_ps(wRight, channel(t10, shift)));
+        __m256 lower = _mm256_add_ps(_mm256_mul_ps(wLeft, channel(t01, shift)), _mm256_mul_ps(wRight, channel(t11, shift)));
+        return _mm256_add_ps(_mm256_mul_ps(wTop, upper), _mm256_mul_ps(wBottom, lower));
+    };
+    _mm256_storeu_ps(batch.r, filter(0));
+    _mm256_storeu_ps(batch.g, filter(8));
+    _mm256_storeu_ps(batch.b, filter(16));
+#elif defined(USE_SSE)
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    __m128 mx = _mm_mul_ps(_mm_loadu_ps(batch.u), _mm_set1_ps(float(this->resolution.x - 1)));
+    __m128 my = _mm_mul_ps(_mm_loadu_ps(batch.v), _mm_set1_ps(float(this->resolution.y - 1)));
+    __m128i xi = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(mx, zero), _mm_set1_ps(float(this->resolution.x) - 1)));
+    __m128i yi = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(my, zero), _mm_set1_ps(float(this->resolution.y) - 1)));
+
+    _mm_storeu_si128((__m128i*)x0, xi);
+    _mm_storeu_si128((__m128i*)y0, yi);
+    _mm_storeu_si128((__m128i*)x1, _mm_add_epi32(xi, _mm_set1_epi32(1)));
+    _mm_storeu_si128((__m128i*)y1, _mm_add_epi32(yi, _mm_set1_epi32(1)));
+    gatherTexels(*this, x0, y0, t00);
+    gatherTexels(*this, x1, y0, t10);
+    gatherTexels(*this, x0, y1, t01);
+    gatherTexels(*this, x1, y1, t11);
+
+    __m128 left = _mm_cvtepi32_ps(xi), top = _mm_cvtepi32_ps(yi);
+    __m128 wLeft = _mm_sub_ps(_mm_add_ps(left, one), mx), wRight = _mm_sub_ps(mx, left);
+    __m128 wTop = _mm_sub_ps(_mm_add_ps(top, one), my), wBottom = _mm_sub_ps(my, top);
+
+    __m128i mask = _mm_set1_epi32(255);
+    __m128 scale = _mm_set1_ps(255.f);
+    auto channel = [&](const uint32_t* texels, int shift) {
+        __m128i t = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)texels), shift);
+        return _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(t, mask)), scale);
+    };
+    auto filter = [&](int shift) {
+        __m128 upper = _mm_add_ps(_mm_mul_ps(wLeft, channel(t00, shift)), _mm_mul_ps(wRight, channel(t10, shift)));
+        __m128 lower = _mm_add_ps(_mm_mul_ps(wLeft, channel(t01, shift)), _mm_mul_ps(wRight, channel(t11, shift)));
+        return _mm_add_ps(_mm_mul_ps(wTop, upper), _mm_mul_ps(wBottom, lower));
+    };
+    _mm_storeu_ps(batch.r, filter(0));
+    _mm_storeu_ps(batch.g, filter(8));
+    _mm_storeu_ps(batch.b, filter(16));
+#else
+    for (int lane = 0; lane < TEXTURE_BATCH_SIZE; lane++) {
+        Vector3f color = this->bilinearFetch(batch.u[lane], batch.v[lane], -1, -1);
+        batch.r[lane] = color.x;
+        batch.g[lane] = color.y;
+        batch.b[lane] = color.z;
+    }
+#endif
+}
+
+// Same texel mapping as bilinearFetch, on one level of the pyramid
+Vector3f Texture::bilinearLevelFetch(float u, float v, int level)
+{
+    Vector2i res = this->levelResolution[level];
+    float tx = clamp(u, 0.f, 1.f) * (res.x - 1);
+    float ty = clamp(v, 0.f, 1.f) * (res.y - 1);
+
+    int x0 = std::min(int(tx), std::max(res.x - 2, 0)), y0 = std::min(int(ty), std::max(res.y - 2, 0));
+    int x1 = std::min(x0 + 1, res.x - 1), y1 = std::min(y0 + 1, res.y - 1);
+    float fx = tx - x0, fy = ty - y0;
+
+    Vector3f top = (1.f - fx) * this->loadPixelColor(x0, y0, level) + fx * this->loadPixelColor(x1, y0, level);
+    Vector3f bottom = (1.f - fx) * this->loadPixelColor(x0, y1, level) + fx * this->loadPixelColor(x1, y1, level);
+    return (1.f - fy) * top + fy * bottom;
+}
+
+Vector3f Texture::trilinearFetch(float u, float v, Vector2f dUVdx, Vector2f dUVdy)
+{
+    // Footprint of the pixel in level 0 texels, along its longer axis
+    float dx = std::max(std::abs(dUVdx.x * this->resolution.x), std::abs(dUVdx.y * this->resolution.y));
+    float dy = std::max(std::abs(dUVdy.x * this->resolution.x), std::abs(dUVdy.y * this->resolution.y));
+    float width = std::max(dx, dy);
+
+    float lod = width > 1.f ? std::log2(width) : 0.f;
+    lod = std::min(lod, float(this->numLevels - 1));
+
+    int level = int(lod);
+    float blend = lod - level;
+    if (blend == 0.f || level + 1 >= this->numLevels)
+        return this->bilinearLevelFetch(u, v, level);
+
+    return (1.f - blend) * this->bilinearLevelFetch(u, v, level) + blend * this->bilinearLevelFetch(u, v, level + 1);
+}
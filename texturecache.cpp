@@ -0,0 +1,396 @@
+#include "texturecache.h"
+#include "meshcache.h"
+
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+struct TextureTileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tileSize;
+    uint64_t key;
+    uint32_t numLevels;
+    int32_t levelResolution[MAX_MIP_LEVELS][2];
+    uint64_t numTiles;
+    uint64_t tilesOffset;
+};
+
+static const char textureTileMagic[8] = {'T', 'E', 'X', 'T', 'I', 'L', 'E', 'S'};
+
+#define TILE_TEXELS (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE)
+#define TILE_BYTES (TILE_TEXELS * sizeof(uint32_t))
+
+// Tiles start on a page boundary, and so, being a whole number of pages, does every tile
+#define TILE_FILE_ALIGNMENT 4096
+
+// Spreads tile keys over the shards
+static int shardOf(uint64_t key)
+{
+    return int((key * 0x9e3779b97f4a7c15ull) >> 59) % TEXTURE_TILE_SHARDS;
+}
+
+static void tileLayout(const TextureTileHeader& header, uint64_t* levelFirstTile, int* levelTilesX, uint64_t& numTiles)
+{
+    numTiles = 0;
+    for (uint32_t level = 0; level < header.numLevels; level++) {
+        int tilesX = (header.levelResolution[level][0] + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        int tilesY = (header.levelResolution[level][1] + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        levelFirstTile[level] = numTiles;
+        levelTilesX[level] = tilesX;
+        numTiles += uint64_t(tilesX) * tilesY;
+    }
+}
+
+#define NO_TILE_KEY ~0ull
+
+static std::atomic<uint64_t> nextCacheId{1};
+
+// The tiles a thread read last and the sequence each had then, so it can read them again without a lock
+struct ThreadTiles {
+    uint64_t cacheId = 0;
+    uint64_t keys[TEXTURE_TILE_THREAD_TILES];
+    const uint32_t* texels[TEXTURE_TILE_THREAD_TILES];
+    const std::atomic<uint64_t>* sequences[TEXTURE_TILE_THREAD_TILES];
+    uint64_t seen[TEXTURE_TILE_THREAD_TILES];
+    int next = 0;
+    std::atomic<size_t>* hits = nullptr;
+};
+
+static thread_local ThreadTiles threadTiles;
+
+TextureTileCache::TextureTileCache(size_t budget, std::string directory)
+    : id(nextCacheId++), budget(budget), directory(directory)
+{
+    // At least one tile per shard, however small the budget, so the cache always keeps TEXTURE_TILE_SHARDS tiles (16, 1 MB)
+    this->slotsPerShard = int(std::max<size_t>(1, budget / TILE_BYTES / TEXTURE_TILE_SHARDS));
+}
+
+TextureTileCache::~TextureTileCache()
+{
+    for (auto& shard : this->shards)
+        for (ResidentTile* tile : shard.tiles)
+            delete tile;
+
+    for (auto& file : this->files) {
+#ifdef _WIN32
+        CloseHandle(file.fileHandle);
+#else
+        close(file.fd);
+#endif
+    }
+}
+
+bool TextureTileCache::open(const std::string& path, Texture& texture)
+{
+    MappedFile image;
+    if (!image.open(path)) return false;
+    uint64_t key = hashBytes(image.data, image.size, TEXTURE_TILE_VERSION);
+    image.close();
+    uint64_t settings[] = {TEXTURE_TILE_SIZE, MAX_MIP_LEVELS};
+    key = hashBytes((const uint8_t*)settings, sizeof(settings), key);
+
+    std::ostringstream filePath;
+    filePath << this->directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".tex";
+
+    if (this->openFile(filePath.str(), key, texture)) return true;
+    return this->writeFile(path, filePath.str(), key) && this->openFile(filePath.str(), key, texture);
+}
+
+bool TextureTileCache::openFile(const std::string& filePath, uint64_t key, Texture& texture)
+{
+    TiledTexture tiled;
+    TextureTileHeader header;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    tiled.fileHandle = file;
+
+    DWORD read = 0;
+    LARGE_INTEGER fileSize;
+    bool valid = ReadFile(file, &header, sizeof(header), &read, nullptr) && read == sizeof(header) && GetFileSizeEx(file, &fileSize);
+    uint64_t size = valid ? uint64_t(fileSize.QuadPart) : 0;
+#else
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    tiled.fd = fd;
+
+    struct stat st;
+    bool valid = pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) && fstat(fd, &st) == 0;
+    uint64_t size = valid ? uint64_t(st.st_size) : 0;
+#endif
+
+    uint64_t numTiles = 0;
+    valid = valid && memcmp(header.magic, textureTileMagic, 8) == 0 && header.version == TEXTURE_TILE_VERSION
+        && header.tileSize == TEXTURE_TILE_SIZE && header.key == key
+        && header.numLevels >= 1 && header.numLevels <= MAX_MIP_LEVELS;
+    if (valid) {
+        tileLayout(header, tiled.levelFirstTile, tiled.levelTilesX, numTiles);
+        valid = numTiles == header.numTiles && header.tilesOffset % TILE_FILE_ALIGNMENT == 0
+            && size >= header.tilesOffset + numTiles * TILE_BYTES;
+    }
+    if (!valid) {
+#ifdef _WIN32
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+        return false;
+    }
+
+    tiled.cache = this;
+    tiled.tilesOffset = header.tilesOffset;
+
+    const TiledTexture* opened;
+    {
+        std::lock_guard<std::mutex> guard(this->filesLock);
+        tiled.fileIdx = this->files.size();
+        this->files.push_back(tiled);
+        opened = &this->files.back();
+    }
+
+    texture = Texture();
+    texture.type = TextureType::UNSIGNED_INTEGER_ALPHA;
+    texture.tiled = opened;
+    texture.numLevels = header.numLevels;
+    for (uint32_t level = 0; level < header.numLevels; level++)
+        texture.levelResolution[level] = Vector2i(header.levelResolution[level][0], header.levelResolution[level][1]);
+    texture.resolution = texture.levelResolution[0];
+    return true;
+}
+
+bool TextureTileCache::writeFile(const std::string& imagePath, const std::string& filePath, uint64_t key)
+{
+    // Decoded whole once, in whatever layout the loaders produce; texelIndex reads any of them
+    Arena scratch;
+    Texture image(imagePath, scratch);
+    if (image.type != TextureType::UNSIGNED_INTEGER_ALPHA) return false;
+
+#ifdef _WIN32
+    _mkdir(this->directory.c_str());
+#else
+    mkdir(this->directory.c_str(), 0755);
+#endif
+
+    TextureTileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, textureTileMagic, 8);
+    header.version = TEXTURE_TILE_VERSION;
+    header.tileSize = TEXTURE_TILE_SIZE;
+    header.key = key;
+    header.numLevels = image.numLevels;
+    for (int level = 0; level < image.numLevels; level++) {
+        header.levelResolution[level][0] = image.levelResolution[level].x;
+        header.levelResolution[level][1] = image.levelResolution[level].y;
+    }
+    uint64_t levelFirstTile[MAX_MIP_LEVELS];
+    int levelTilesX[MAX_MIP_LEVELS];
+    tileLayout(header, levelFirstTile, levelTilesX, header.numTiles);
+    header.tilesOffset = (sizeof(header) + TILE_FILE_ALIGNMENT - 1) / TILE_FILE_ALIGNMENT * TILE_FILE_ALIGNMENT;
+
+    // Written under a name of its own and renamed, so a concurrent run never reads half a file
+    std::ostringstream tempPath;
+    tempPath << filePath << "." << std::this_thread::get_id() << ".tmp";
+    std::ofstream out(tempPath.str(), std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    std::vector<char> zeros(header.tilesOffset - sizeof(header), 0);
+    out.write(zeros.data(), zeros.size());
+
+    // Texels past the edge of a level repeat the last row or column
+    uint32_t tile[TILE_TEXELS];
+    for (int level = 0; level < image.numLevels; level++) {
+        Vector2i res = image.levelResolution[level];
+        const uint32_t* texels = (const uint32_t*)image.levels[level];
+        for (int ty = 0; ty * TEXTURE_TILE_SIZE < res.y; ty++) {
+            for (int tx = 0; tx * TEXTURE_TILE_SIZE < res.x; tx++) {
+                for (int y = 0; y < TEXTURE_TILE_SIZE; y++) {
+                    int sy = std::min(ty * TEXTURE_TILE_SIZE + y, res.y - 1);
+                    for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+                        int sx = std::min(tx * TEXTURE_TILE_SIZE + x, res.x - 1);
+                        tile[y * TEXTURE_TILE_SIZE + x] = texels[image.texelIndex(sx, sy, level)];
+                    }
+                }
+                out.write((const char*)tile, TILE_BYTES);
+            }
+        }
+    }
+    out.close();
+
+    if (!out || std::rename(tempPath.str().c_str(), filePath.c_str()) != 0) {
+        std::cerr << "Could not write texture tile file " << filePath << std::endl;
+        std::remove(tempPath.str().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void TextureTileCache::readTile(const TiledTexture& tiled, uint64_t tile, uint32_t* texels)
+{
+    uint64_t offset = tiled.tilesOffset + tile * TILE_BYTES;
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = DWORD(offset);
+    overlapped.OffsetHigh = DWORD(offset >> 32);
+    DWORD read = 0;
+    bool ok = ReadFile(tiled.fileHandle, texels, TILE_BYTES, &read, &overlapped) && read == TILE_BYTES;
+#else
+    bool ok = pread(tiled.fd, texels, TILE_BYTES, offset) == ssize_t(TILE_BYTES);
+#endif
+    if (!ok) {
+        std::cerr << "Could not read texture tile " << tile << " of tile file " << tiled.fileIdx << std::endl;
+        exit(1);
+    }
+}
+
+uint32_t TextureTileCache::texel(const TiledTexture& tiled, int x, int y, int level)
+{
+    int tx = x / TEXTURE_TILE_SIZE, ty = y / TEXTURE_TILE_SIZE;
+    uint64_t tile = tiled.levelFirstTile[level] + uint64_t(ty) * tiled.levelTilesX[level] + tx;
+    uint64_t key = (uint64_t(tiled.fileIdx) << 40) | tile;
+    int offset = (y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE;
+
+    ThreadTiles& own = threadTiles;
+    if (own.cacheId != this->id) {
+        own = ThreadTiles();
+        own.cacheId = this->id;
+        std::fill(own.keys, own.keys + TEXTURE_TILE_THREAD_TILES, NO_TILE_KEY);
+        std::lock_guard<std::mutex> guard(this->threadHitsLock);
+        this->threadHits.emplace_back();
+        own.hits = &this->threadHits.back().count;
+    }
+
+    // Read like a seqlock: the texel counts only if the tile still has the sequence it had when this
+    // thread last saw it under the shard lock; otherwise it was evicted meanwhile, maybe mid-read
+    for (int i = 0; i < TEXTURE_TILE_THREAD_TILES; i++) {
+        if (own.keys[i] != key) continue;
+        uint32_t value = own.texels[i][offset];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (own.sequences[i]->load(std::memory_order_relaxed) == own.seen[i]) {
+            // Only this thread writes its count, so it needs no atomic increment
+            own.hits->store(own.hits->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return value;
+        }
+        own.keys[i] = NO_TILE_KEY;
+        break;
+    }
+
+    Shard& shard = this->shards[shardOf(key)];
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    auto unlink = [&](int slot) {
+        if (shard.prev[slot] >= 0) shard.next[shard.prev[slot]] = shard.next[slot];
+        else shard.head = shard.next[slot];
+        if (shard.next[slot] >= 0) shard.prev[shard.next[slot]] = shard.prev[slot];
+        else shard.tail = shard.prev[slot];
+    };
+    auto pushFront = [&](int slot) {
+        shard.prev[slot] = -1;
+        shard.next[slot] = shard.head;
+        if (shard.head >= 0) shard.prev[shard.head] = slot;
+        shard.head = slot;
+        if (shard.tail < 0) shard.tail = slot;
+    };
+
+    int slot;
+    auto it = shard.slots.find(key);
+    if (it != shard.slots.end()) {
+        shard.hits++;
+        slot = it->second;
+        if (slot != shard.head) {
+            unlink(slot);
+            pushFront(slot);
+        }
+    }
+    else {
+        shard.misses++;
+        if (int(shard.tiles.size()) < this->slotsPerShard) {
+            slot = int(shard.tiles.size());
+            ResidentTile* resident = new (std::nothrow) ResidentTile;
+            if (!resident) {
+                std::cerr << "Out of memory allocating a texture tile" << std::endl;
+                exit(1);
+            }
+            shard.tiles.push_back(resident);
+            shard.prev.push_back(-1);
+            shard.next.push_back(-1);
+        }
+        else {
+            slot = shard.tail;
+            shard.evictions++;
+            shard.slots.erase(shard.tiles[slot]->key);
+            unlink(slot);
+        }
+
+        // Threads holding the old tile see the odd sequence, or a newer one, and come here instead
+        ResidentTile& resident = *shard.tiles[slot];
+        uint64_t sequence = resident.sequence.load(std::memory_order_relaxed);
+        resident.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        this->readTile(tiled, tile, resident.texels);
+        resident.sequence.store(sequence + 2, std::memory_order_release);
+
+        resident.key = key;
+        shard.slots[key] = slot;
+        pushFront(slot);
+    }
+
+    const ResidentTile& resident = *shard.tiles[slot];
+    int i = own.next;
+    own.next = (own.next + 1) % TEXTURE_TILE_THREAD_TILES;
+    own.keys[i] = key;
+    own.texels[i] = resident.texels;
+    own.sequences[i] = &resident.sequence;
+    own.seen[i] = resident.sequence.load(std::memory_order_relaxed);
+    return resident.texels[offset];
+}
+
+size_t TextureTileCache::hits() const
+{
+    size_t total = 0;
+    for (auto& shard : this->shards) total += shard.hits;
+    std::lock_guard<std::mutex> guard(this->threadHitsLock);
+    for (auto& thread : this->threadHits) total += thread.count.load();
+    return total;
+}
+
+size_t TextureTileCache::misses() const
+{
+    size_t total = 0;
+    for (auto& shard : this->shards) total += shard.misses;
+    return total;
+}
+
+size_t TextureTileCache::evictions() const
+{
+    size_t total = 0;
+    for (auto& shard : this->shards) total += shard.evictions;
+    return total;
+}
+
+size_t TextureTileCache::bytesResident() const
+{
+    size_t total = 0;
+    for (auto& shard : this->shards) total += shard.tiles.size() * TILE_BYTES;
+    return total;
+}
+
+void TextureTileCache::report() const
+{
+    size_t hits = this->hits(), misses = this->misses();
+    std::cout << "Texture tiles: " << hits << " hits, " << misses << " misses ("
+        << (hits + misses ? 100.f * hits / (hits + misses) : 0.f) << "% hit rate), " << this->evictions() << " evictions, "
+        << this->bytesResident() / (1024.f * 1024.f) << " MB resident of a " << this->budget / (1024.f * 1024.f) << " MB budget" << std::endl;
+}